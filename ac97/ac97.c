@@ -21,13 +21,25 @@
  */
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "clib_sys.h"
 #include "clib_pci.h"
 #include "clib_term.h"
 
-uint8_t  first = 1, silent = 0, bus, dev, func;
-uint16_t i, io_base, alt_io_base;
+#define CODEC_TIMEOUT_US 100000UL  /* codec register access */
+#define WAKE_TIMEOUT_US  1000000UL /* AC-Link wakeup */
+#define TIME_CYCLES      100       /* default -t cycle count */
+#define TIME_CYCLES_MAX  256
+/* Registers safe to write back during -t: mixer volumes, tone, beep,
+   record select/gain, general purpose (02-20) and surround volumes (36-38).
+   Bit n corresponds to register n * 2. */
+#define TIME_WRITE_REGS  0x1801fffeUL
+
+uint8_t    first = 1, silent = 0, timing = 0, bus, dev, func;
+uint16_t   i, io_base, alt_io_base, time_cycles = 0, codec_timeouts, time_results[64][2][4];
+uint32_t   codec_wait_max, time_samples[TIME_CYCLES_MAX];
+deadline_t codec_wait;
 
 static void
 codec_probe(uint16_t (*codec_read)(uint8_t reg),
@@ -39,6 +51,7 @@ codec_probe(uint16_t (*codec_read)(uint8_t reg),
     FILE    *f;
 
     /* Reset codec. */
+    codec_wait_max = 0;
     if (!silent)
         printf("\nResetting codec...");
     codec_write(0x00, 0xffff);
@@ -125,6 +138,10 @@ codec_probe(uint16_t (*codec_read)(uint8_t reg),
             putchar('\n');
     } while (cur_reg < 0x80);
 
+    /* Print how long the slowest codec access had to wait for the controller. */
+    if (!silent)
+        printf("Longest codec wait: %" PRIu32 " us\n", codec_wait_max);
+
     /* Generate and print dump file name. */
     sprintf(buf, "COD%02X%02X%d.BIN", bus, dev, func);
     printf("Saving codec %c%c%c%02X register dump to %s\n",
@@ -145,17 +162,143 @@ codec_probe(uint16_t (*codec_read)(uint8_t reg),
     fclose(f);
 }
 
+static uint16_t
+time_clamp(uint32_t us, uint32_t overhead)
+{
+    /* Subtract the timer's own overhead and saturate to 16 bits. */
+    us = (us > overhead) ? (us - overhead) : 0;
+    return (us > 0xffff) ? 0xffff : us;
+}
+
+static void
+time_summarize(uint16_t *stats, uint32_t overhead)
+{
+    uint16_t j, k;
+    uint32_t val;
+
+    /* Sort samples. */
+    for (j = 1; j < time_cycles; j++) {
+        val = time_samples[j];
+        for (k = j; k && (time_samples[k - 1] > val); k--)
+            time_samples[k] = time_samples[k - 1];
+        time_samples[k] = val;
+    }
+
+    /* Take minimum, median, 99th percentile (nearest rank) and maximum. */
+    stats[0] = time_clamp(time_samples[0], overhead);
+    stats[1] = time_clamp(time_samples[time_cycles >> 1], overhead);
+    stats[2] = time_clamp(time_samples[((((uint32_t) time_cycles) * 99) + 99) / 100 - 1], overhead);
+    stats[3] = time_clamp(time_samples[time_cycles - 1], overhead);
+}
+
+static void
+codec_time(uint16_t (*codec_read)(uint8_t reg),
+           void (*codec_write)(uint8_t reg, uint16_t val))
+{
+    uint8_t  reg;
+    uint16_t j, val, header[3];
+    uint32_t start;
+    char     buf[16];
+    FILE    *f;
+
+    /* Measure the timer's own overhead. */
+    for (j = 0; j < time_cycles; j++) {
+        start           = timer_now();
+        time_samples[j] = timer_elapsed_us(start);
+    }
+    time_summarize(time_results[0][0], 0);
+    header[0] = time_cycles;
+    header[1] = time_results[0][0][0];
+
+    /* Count timeouts instead of marking them while timing. */
+    codec_timeouts = 0;
+    timing         = 1;
+
+    if (!silent)
+        printf("\nTiming %d codec accesses per register...", time_cycles);
+    for (reg = 0; reg < 0x80; reg += 2) {
+        /* Time reads. */
+        for (j = 0; j < time_cycles; j++) {
+            start           = timer_now();
+            val             = codec_read(reg);
+            time_samples[j] = timer_elapsed_us(start);
+        }
+        time_summarize(time_results[reg >> 1][0], header[1]);
+
+        /* Time writes of the value last read, only to known read/write registers. */
+        if (TIME_WRITE_REGS & (1UL << (reg >> 1))) {
+            for (j = 0; j < time_cycles; j++) {
+                start = timer_now();
+                codec_write(reg, val);
+                time_samples[j] = timer_elapsed_us(start);
+            }
+            time_summarize(time_results[reg >> 1][1], header[1]);
+        } else {
+            memset(time_results[reg >> 1][1], 0, sizeof(time_results[reg >> 1][1]));
+        }
+    }
+    timing    = 0;
+    header[2] = codec_timeouts;
+
+    /* Print summary table. */
+    if (!silent) {
+        printf(" done (timer overhead %d us, %d timeouts).\n", header[1], header[2]);
+        printf("Reg  Read:   min   med   p99   max  Write:   min   med   p99   max\n");
+        for (reg = 0; reg < 0x80; reg += 2) {
+            printf("%02X:       ", reg);
+            for (j = 0; j < 4; j++)
+                printf(" %5u", time_results[reg >> 1][0][j]);
+            printf("        ");
+            if (TIME_WRITE_REGS & (1UL << (reg >> 1))) {
+                for (j = 0; j < 4; j++)
+                    printf(" %5u", time_results[reg >> 1][1][j]);
+            } else {
+                printf("     -     -     -     -");
+            }
+            putchar('\n');
+        }
+    }
+
+    /* Generate and print timing file name. */
+    sprintf(buf, "TIM%02X%02X%d.BIN", bus, dev, func);
+    printf("Saving codec access times to %s\n", buf);
+
+    /* Write timing file. */
+    f = fopen(buf, "wb");
+    if (!f) {
+        printf("File creation failed\n");
+        return;
+    }
+    if ((fwrite(header, 1, sizeof(header), f) < sizeof(header)) || (fwrite(time_results, 1, sizeof(time_results), f) < sizeof(time_results)))
+        printf("File write failed\n");
+    fclose(f);
+}
+
+static void
+codec_wait_end(int timed_out)
+{
+    /* Record how long this wait took, keeping the longest one for the codec probe to report. */
+    if (!timed_out)
+        deadline_stop(&codec_wait);
+    if (codec_wait.elapsed > codec_wait_max)
+        codec_wait_max = codec_wait.elapsed;
+    if (timed_out) {
+        if (timing)
+            codec_timeouts++;
+        else
+            printf("[!]");
+    }
+}
+
 static void
 audiopci_codec_wait(multi_t *regval)
 {
     /* Wait for WIP to be cleared. */
-    for (i = 1; i; i++) {
+    deadline_start(&codec_wait, CODEC_TIMEOUT_US);
+    do {
         regval->u32 = inl(io_base | 0x14);
-        if (!(regval->u16[1] & 0x4000))
-            break;
-    }
-    if (!i)
-        printf("[!]");
+    } while ((regval->u16[1] & 0x4000) && !deadline_passed(&codec_wait));
+    codec_wait_end(regval->u16[1] & 0x4000);
 }
 
 static uint16_t
@@ -229,18 +372,21 @@ audiopci_probe(uint16_t dev_id)
 
     /* Perform codec probe. */
     codec_probe(audiopci_codec_read, audiopci_codec_write);
+    if (time_cycles)
+        codec_time(audiopci_codec_read, audiopci_codec_write);
 }
 
 static void
 emu10k1_codec_wait()
 {
+    uint8_t val;
+
     /* Wait for AC97ADDRESS_READY to be set. */
-    for (i = 1; i; i++) {
-        if (inb(io_base | 0x1e) & 0x80)
-            break;
-    }
-    if (!i)
-        printf("[!]");
+    deadline_start(&codec_wait, CODEC_TIMEOUT_US);
+    do {
+        val = inb(io_base | 0x1e);
+    } while (!(val & 0x80) && !deadline_passed(&codec_wait));
+    codec_wait_end(!(val & 0x80));
 }
 
 static uint16_t
@@ -293,6 +439,8 @@ emu10k1_probe(uint16_t dev_id)
 
     /* Perform codec probe. */
     codec_probe(emu10k1_codec_read, emu10k1_codec_write);
+    if (time_cycles)
+        codec_time(emu10k1_codec_read, emu10k1_codec_write);
 }
 
 static void
@@ -302,13 +450,11 @@ via_codec_wait(multi_t *regval, uint16_t additional)
 
     /* Wait for Controller Busy to be cleared and additional bits to be set. */
     mask |= additional;
-    for (i = 1; i; i++) {
+    deadline_start(&codec_wait, CODEC_TIMEOUT_US);
+    do {
         regval->u32 = inl(io_base | 0x80);
-        if ((regval->u16[1] & mask) == additional)
-            break;
-    }
-    if (!i)
-        printf("[!]");
+    } while (((regval->u16[1] & mask) != additional) && !deadline_passed(&codec_wait));
+    codec_wait_end((regval->u16[1] & mask) != additional);
 }
 
 static uint16_t
@@ -375,15 +521,14 @@ via_probe(uint16_t dev_id)
     /* Set up AC-Link interface. */
     printf("Waking codec up... ");
     pci_writeb(bus, dev, func, 0x41, (dev_id == 0x3058) ? 0xc4 : 0xc0);
-    for (i = 1; i; i++) {
-        if (pci_readb(bus, dev, func, 0x40) & 0x01)
-            break;
-    }
-    if (!i) {
-        printf("timed out!\n");
-        return;
+    deadline_start(&codec_wait, WAKE_TIMEOUT_US);
+    while (!(pci_readb(bus, dev, func, 0x40) & 0x01)) {
+        if (deadline_passed(&codec_wait)) {
+            printf("timed out!\n");
+            return;
+        }
     }
-    printf("done.\n");
+    printf("done in %" PRIu32 " us.\n", deadline_stop(&codec_wait));
 
     /* Test Codec Shadow I/O BAR on 686. */
     if (dev_id == 0x3058) {
@@ -417,18 +562,21 @@ via_probe(uint16_t dev_id)
 
     /* Perform codec probe. */
     codec_probe(via_codec_read, via_codec_write);
+    if (time_cycles)
+        codec_time(via_codec_read, via_codec_write);
 }
 
 static void
 intel_codec_wait()
 {
+    uint8_t val;
+
     /* Wait for CAS to be cleared. */
-    for (i = 1; i; i++) {
-        if (!(inb(alt_io_base | 0x34) & 0x01))
-            break;
-    }
-    if (!i)
-        printf("[!]");
+    deadline_start(&codec_wait, CODEC_TIMEOUT_US);
+    do {
+        val = inb(alt_io_base | 0x34);
+    } while ((val & 0x01) && !deadline_passed(&codec_wait));
+    codec_wait_end(val & 0x01);
 }
 
 static uint16_t
@@ -476,21 +624,21 @@ intel_probe(const char *name, uint16_t dev_id)
     globcnt = inl(alt_io_base | 0x2c) & ~0x00000008;
     outl(alt_io_base | 0x2c, globcnt & ~0x00000002);
     globcnt = inl(alt_io_base | 0x2c);
-    for (i = 1; i; i++) /* unknown delay required */
-        inb(0xeb);
+    delay(65); /* unknown delay required, roughly what 65536 reads from port EB take */
     outl(alt_io_base | 0x2c, globcnt | 0x00000002);
-    for (i = 1; i; i++) {
-        if (inl(alt_io_base | 0x30) & 0x00000100)
-            break;
-    }
-    if (!i) {
-        printf("timed out!\n");
-        return;
+    deadline_start(&codec_wait, WAKE_TIMEOUT_US);
+    while (!(inl(alt_io_base | 0x30) & 0x00000100)) {
+        if (deadline_passed(&codec_wait)) {
+            printf("timed out!\n");
+            return;
+        }
     }
-    printf("done.\n");
+    printf("done in %" PRIu32 " us.\n", deadline_stop(&codec_wait));
 
     /* Perform codec probe. */
     codec_probe(intel_codec_read, intel_codec_write);
+    if (time_cycles)
+        codec_time(intel_codec_read, intel_codec_write);
 }
 
 static void
@@ -534,6 +682,7 @@ int
 main(int argc, char **argv)
 {
     uint8_t dev, func;
+    int     j, n;
 
     /* Disable stdout buffering. */
     term_unbuffer_stdout();
@@ -542,9 +691,23 @@ main(int argc, char **argv)
     if (!pci_init())
         return 1;
 
-    /* Set silent mode. */
-    if ((argc > 1) && !strcmp(argv[1], "-s"))
-        silent = 1;
+    /* Parse arguments. */
+    for (j = 1; j < argc; j++) {
+        if (!strcmp(argv[j], "-s")) {
+            /* Set silent mode. */
+            silent = 1;
+        } else if (!strcmp(argv[j], "-t")) {
+            /* Set timing mode, with an optional cycle count. */
+            n = TIME_CYCLES;
+            if (((j + 1) < argc) && (argv[j + 1][0] >= '0') && (argv[j + 1][0] <= '9'))
+                n = atoi(argv[++j]);
+            if (n < 1)
+                n = 1;
+            else if (n > TIME_CYCLES_MAX)
+                n = TIME_CYCLES_MAX;
+            time_cycles = n;
+        }
+    }
 
     /* Scan PCI bus 0. */
     pci_scan_bus(0, pci_scan_callback);
@@ -28,7 +28,8 @@
 #endif
 #include "clib_sys.h"
 
-uint8_t pci_mechanism = 0, pci_device_count = 0;
+uint8_t  pci_mechanism = 0, pci_device_count = 0;
+uint16_t pci_segment = 0;
 #ifdef PCI_LIB_VERSION
 struct pci_access        *pacc;
 static struct pci_dev    *pdev = NULL;
@@ -38,6 +39,18 @@ static struct pci_dev    *dummy_buses[256] = {0};
 static const char         win_notice[] = "NOTICE:         These are dummy configuration registers generated by libpci, as it cannot access the real ones under Windows. They do not reflect the device's actual configuration.";
 #    endif
 #endif
+#ifdef __POSIX_UEFI__
+/* Mechanism 3 goes through the firmware's PCI Root Bridge I/O protocol instances,
+   each of which covers a range of buses on one segment. */
+typedef struct {
+    efi_pci_root_bridge_io_protocol_t *rbio;
+    uint16_t                           segment;
+    uint8_t                            bus_min, bus_max;
+} pci_root_t;
+static pci_root_t *pci_roots     = NULL;
+static pci_root_t *pci_last_root = NULL;
+static int         pci_root_count = 0;
+#endif
 
 /* Configuration functions. */
 uint32_t
@@ -124,6 +137,81 @@ pci_get_mem_bar(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg, uint32_t si
 }
 #endif
 
+#ifdef __POSIX_UEFI__
+static void
+pci_efi_init()
+{
+    efi_guid_t                         guid    = EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_GUID;
+    efi_handle_t                      *handles = NULL;
+    efi_pci_root_bridge_io_protocol_t *rbio;
+    uintn_t                            count = 0, i;
+    uint8_t                           *desc;
+    pci_root_t                         root;
+    int                                j;
+
+    if (EFI_ERROR(BS->LocateHandleBuffer(ByProtocol, &guid, NULL, &count, &handles)) || !count)
+        return;
+    pci_roots = malloc(count * sizeof(pci_root_t));
+    if (pci_roots) {
+        for (i = 0; i < count; i++) {
+            if (EFI_ERROR(BS->HandleProtocol(handles[i], &guid, (void **) &rbio)) || !rbio)
+                continue;
+            root.rbio    = rbio;
+            root.segment = rbio->SegmentNumber;
+            root.bus_min = 0x00;
+            root.bus_max = 0xff;
+
+            /* Look for the bus number range among the root bridge's resource descriptors. */
+            if (!EFI_ERROR(rbio->Configuration(rbio, (void **) &desc)) && desc) {
+                for (; desc[0] == 0x8a; desc += 3 + *((uint16_t *) &desc[1])) {
+                    if (desc[3] == 2) {
+                        root.bus_min = *((uint64_t *) &desc[14]);
+                        root.bus_max = *((uint64_t *) &desc[22]);
+                        break;
+                    }
+                }
+            }
+
+            /* Keep the list sorted by segment and bus. */
+            for (j = pci_root_count; (j > 0) && ((pci_roots[j - 1].segment > root.segment) || ((pci_roots[j - 1].segment == root.segment) && (pci_roots[j - 1].bus_min > root.bus_min))); j--)
+                pci_roots[j] = pci_roots[j - 1];
+            pci_roots[j] = root;
+            pci_root_count++;
+        }
+    }
+    BS->FreePool(handles);
+}
+
+static efi_pci_root_bridge_io_protocol_t *
+pci_efi_root(uint8_t bus)
+{
+    int i;
+
+    /* Accesses tend to stay on the same root bridge. */
+    if (pci_last_root && (pci_last_root->segment == pci_segment) && (bus >= pci_last_root->bus_min) && (bus <= pci_last_root->bus_max))
+        return pci_last_root->rbio;
+    for (i = 0; i < pci_root_count; i++) {
+        if ((pci_roots[i].segment == pci_segment) && (bus >= pci_roots[i].bus_min) && (bus <= pci_roots[i].bus_max)) {
+            pci_last_root = &pci_roots[i];
+            return pci_last_root->rbio;
+        }
+    }
+    return NULL;
+}
+
+static int
+pci_efi_access(int write, uint8_t bus, uint8_t dev, uint8_t func, uint16_t reg, efi_pci_root_bridge_io_width_t width, uintn_t count, void *buf)
+{
+    efi_pci_root_bridge_io_protocol_t *rbio = pci_efi_root(bus);
+    efi_pci_root_bridge_io_mem_t       access;
+
+    if (!rbio)
+        return 0;
+    access = write ? rbio->Pci.Write : rbio->Pci.Read;
+    return !EFI_ERROR(access(rbio, width, EFI_PCI_ADDRESS(bus, dev, func, reg), count, buf));
+}
+#endif
+
 #ifdef PCI_LIB_VERSION
 static void
 pci_printf(char *msg, ...)
@@ -234,9 +322,40 @@ pci_init_dev(uint8_t bus, uint8_t dev, uint8_t func)
 }
 #endif
 
+int
+pci_get_root(int index, uint16_t *segment, uint8_t *bus)
+{
+#ifdef __POSIX_UEFI__
+    /* Each root bridge has its own root bus. */
+    if (pci_mechanism == 3) {
+        if (index >= pci_root_count)
+            return 0;
+        *segment = pci_roots[index].segment;
+        *bus     = pci_roots[index].bus_min;
+        return 1;
+    }
+#endif
+
+    /* Otherwise, everything is reached through bus 0 on segment 0. */
+    if (index)
+        return 0;
+    *segment = 0;
+    *bus     = 0;
+    return 1;
+}
+
 int
 pci_init()
 {
+#ifdef __POSIX_UEFI__
+    /* Prefer the firmware's root bridges, which also work without the legacy configuration ports. */
+    pci_efi_init();
+    if (pci_root_count) {
+        pci_mechanism    = 3;
+        pci_device_count = 32;
+        return pci_mechanism;
+    }
+#endif
 #ifdef PCI_LIB_VERSION
     char *debug;
 
@@ -308,6 +427,13 @@ pci_readb(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg)
             ret = cf8 >> ((reg & 0x03) << 3);
             break;
 
+#    ifdef __POSIX_UEFI__
+        case 3:
+            if (!pci_efi_access(0, bus, dev, func, reg, EfiPciWidthUint8, 1, &ret))
+                ret = 0xff;
+            break;
+
+#    endif
         default:
             ret = 0xff;
             break;
@@ -342,6 +468,13 @@ pci_readw(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg)
             ret = cf8 >> ((reg & 0x02) << 3);
             break;
 
+#    ifdef __POSIX_UEFI__
+        case 3:
+            if (!pci_efi_access(0, bus, dev, func, reg, EfiPciWidthUint16, 1, &ret))
+                ret = 0xffff;
+            break;
+
+#    endif
         default:
             ret = 0xffff;
             break;
@@ -380,6 +513,13 @@ pci_readl(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg)
             sti();
             break;
 
+#    ifdef __POSIX_UEFI__
+        case 3:
+            if (!pci_efi_access(0, bus, dev, func, reg, EfiPciWidthUint32, 1, &ret))
+                ret = 0xffffffff;
+            break;
+
+#    endif
         default:
             ret = 0xffffffff;
             break;
@@ -418,6 +558,12 @@ pci_writeb(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg, uint8_t val)
             cf8 |= val << shift;
             pci_writel(bus, dev, func, reg, cf8);
             break;
+
+#    ifdef __POSIX_UEFI__
+        case 3:
+            pci_efi_access(1, bus, dev, func, reg, EfiPciWidthUint8, 1, &val);
+            break;
+#    endif
     }
 #endif
 }
@@ -451,6 +597,12 @@ pci_writew(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg, uint16_t val)
             cf8 |= val << shift;
             pci_writel(bus, dev, func, reg, cf8);
             break;
+
+#    ifdef __POSIX_UEFI__
+        case 3:
+            pci_efi_access(1, bus, dev, func, reg, EfiPciWidthUint16, 1, &val);
+            break;
+#    endif
     }
 #endif
 }
@@ -484,8 +636,44 @@ pci_writel(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg, uint32_t val)
             outl(data_port, val);
             sti();
             break;
+
+#    ifdef __POSIX_UEFI__
+        case 3:
+            pci_efi_access(1, bus, dev, func, reg, EfiPciWidthUint32, 1, &val);
+            break;
+#    endif
+    }
+#endif
+}
+
+int
+pci_read_regs(uint8_t bus, uint8_t dev, uint8_t func, uint16_t reg, uint16_t len, void *buf)
+{
+    /* Read len bytes of dword-aligned registers in one go where possible. Registers
+       which can't be read, such as extended ones without PCI Express, read as FF. */
+    if ((reg | len) & 3)
+        return 0; /* reject unaligned ranges without touching the buffer */
+#ifdef PCI_LIB_VERSION
+    pci_init_dev(bus, dev, func);
+    if (pdev && pci_read_block(pdev, reg, buf, len))
+        return 1;
+#else
+    uint16_t i;
+
+#    ifdef __POSIX_UEFI__
+    /* A single call fetches the whole range. */
+    if ((pci_mechanism == 3) && pci_efi_access(0, bus, dev, func, reg, EfiPciWidthUint32, len >> 2, buf))
+        return 1;
+#    endif
+    if (pci_mechanism && ((reg + len) <= 256)) {
+        for (i = 0; i < len; i += 4)
+            *((uint32_t *) &((uint8_t *) buf)[i]) = pci_readl(bus, dev, func, reg + i);
+        return 1;
     }
 #endif
+
+    memset(buf, 0xff, len);
+    return 0;
 }
 
 void
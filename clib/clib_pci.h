@@ -29,7 +29,8 @@ extern struct pci_access *pacc;
 #endif
 
 /* Global variables. */
-extern uint8_t pci_mechanism, pci_device_count;
+extern uint8_t  pci_mechanism, pci_device_count;
+extern uint16_t pci_segment;
 
 /* Configuration functions. */
 extern uint32_t pci_cf8(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg);
@@ -37,6 +38,7 @@ extern uint16_t pci_get_io_bar(uint8_t bus, uint8_t dev, uint8_t func, uint8_t r
 #ifdef IS_32BIT
 extern uint32_t pci_get_mem_bar(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg, uint32_t size, const char *name);
 #endif
+extern int      pci_get_root(int index, uint16_t *segment, uint8_t *bus);
 extern int      pci_init();
 extern uint8_t  pci_readb(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg);
 extern uint16_t pci_readw(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg);
@@ -44,6 +46,7 @@ extern uint32_t pci_readl(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg);
 extern void     pci_writeb(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg, uint8_t val);
 extern void     pci_writew(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg, uint16_t val);
 extern void     pci_writel(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg, uint32_t val);
+extern int      pci_read_regs(uint8_t bus, uint8_t dev, uint8_t func, uint16_t reg, uint16_t len, void *buf);
 extern void     pci_scan_bus(uint8_t bus,
                              void (*callback)(uint8_t bus, uint8_t dev, uint8_t func,
                                           uint16_t ven_id, uint16_t dev_id));
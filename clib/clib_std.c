@@ -18,9 +18,17 @@
 #ifdef __POSIX_UEFI__
 #    include <uefi.h>
 #else
+#    include <stdlib.h>
 #    include <string.h>
+#    if defined(__WATCOMC__) && defined(M_I386) && (defined(__DOS__) || defined(__PMODEW__))
+#        include <i86.h>
+#        define ARENA_DPMI 1
+#    endif
 #endif
 #include "clib_std.h"
+#if defined(__POSIX_UEFI__) || defined(ARENA_DPMI)
+#    define ARENA_REGIONS 1
+#endif
 
 /* String functions. */
 int
@@ -71,3 +79,191 @@ comp_ui8(const void *elem1, const void *elem2)
     uint8_t b = *((uint8_t *) elem2);
     return ((a < b) ? -1 : ((a > b) ? 1 : 0));
 }
+
+/* Memory functions. */
+#ifdef ARENA_REGIONS
+/* Allocations which live for the whole run are carved out of large regions
+   obtained from the firmware or DPMI host, instead of costing one call to it
+   each. Each allocation is preceded by its size, so that the most recent one
+   can be given back, which lets temporary buffers be freed in reverse order
+   of allocation. Nothing here is thread-safe, as these targets have no threads. */
+#    define ARENA_ALIGN       16
+#    define ARENA_ROUND(x)    (((x) + (ARENA_ALIGN - 1)) & ~((size_t) (ARENA_ALIGN - 1)))
+#    define ARENA_PAGE        4096
+#    define ARENA_REGION_SIZE ((size_t) 256 << 10) /* smallest region obtained at a time */
+#    define ARENA_HEADER      ARENA_ROUND(sizeof(arena_region_t))
+#    define ARENA_PREFIX      ARENA_ALIGN /* holds the allocation's size */
+
+typedef struct _arena_region_ {
+    struct _arena_region_ *next;
+    size_t                 size, used;
+    uint32_t               handle; /* DPMI memory block handle */
+} arena_region_t;
+
+static arena_region_t *arena_regions = NULL; /* the first region is the one being filled */
+
+static arena_region_t *
+arena_region_new(size_t size)
+{
+    arena_region_t *region;
+#    ifdef __POSIX_UEFI__
+    efi_physical_address_t addr;
+#    else
+    union REGS regs;
+#    endif
+
+    /* Obtain whole pages, enough for the header and the requested size. */
+    size = (MAX(size + ARENA_HEADER, ARENA_REGION_SIZE) + (ARENA_PAGE - 1)) & ~((size_t) (ARENA_PAGE - 1));
+#    ifdef __POSIX_UEFI__
+    if (EFI_ERROR(BS->AllocatePages(AllocateAnyPages, LIP ? LIP->ImageDataType : EfiLoaderData, size / ARENA_PAGE, &addr)))
+        return NULL;
+    region         = (arena_region_t *) (uintptr_t) addr;
+    region->handle = 0;
+#    else
+    /* DPMI function 0501h: allocate memory block. The linear address
+       is usable as-is, as the flat model's segments are zero-based. */
+    memset(&regs, 0, sizeof(regs));
+    regs.w.ax = 0x0501;
+    regs.w.bx = size >> 16;
+    regs.w.cx = size;
+    int386(0x31, &regs, &regs);
+    if (regs.w.cflag)
+        return NULL;
+    region         = (arena_region_t *) (((uint32_t) regs.w.bx << 16) | regs.w.cx);
+    region->handle = ((uint32_t) regs.w.si << 16) | regs.w.di;
+#    endif
+    region->size = size - ARENA_HEADER;
+    region->used = 0;
+    return region;
+}
+
+static void
+arena_region_release(arena_region_t *region)
+{
+#    ifdef __POSIX_UEFI__
+    BS->FreePages((efi_physical_address_t) (uintptr_t) region, (region->size + ARENA_HEADER) / ARENA_PAGE);
+#    else
+    union REGS regs;
+
+    /* DPMI function 0502h: free memory block. */
+    memset(&regs, 0, sizeof(regs));
+    regs.w.ax = 0x0502;
+    regs.w.si = region->handle >> 16;
+    regs.w.di = region->handle;
+    int386(0x31, &regs, &regs);
+#    endif
+}
+
+void *
+arena_alloc(size_t size)
+{
+    arena_region_t *region = arena_regions;
+    uint8_t        *ptr;
+
+    /* Reject sizes which would overflow once rounded up. */
+    if (size > ((size_t) -1 - ARENA_REGION_SIZE))
+        return NULL;
+    size = ARENA_PREFIX + ARENA_ROUND(size);
+
+    /* Start a new region if this one is full. Allocations too large to
+       share a region get their own, behind the one being filled. */
+    if (!region || ((region->size - region->used) < size)) {
+        region = arena_region_new(size);
+        if (!region)
+            return NULL;
+        if (arena_regions && (size > (ARENA_REGION_SIZE / 4))) {
+            region->next        = arena_regions->next;
+            arena_regions->next = region;
+        } else {
+            region->next  = arena_regions;
+            arena_regions = region;
+        }
+    }
+
+    /* Bump allocate. */
+    ptr = (uint8_t *) region + ARENA_HEADER + region->used;
+    *((size_t *) ptr) = size;
+    region->used += size;
+    return ptr + ARENA_PREFIX;
+}
+
+void *
+arena_calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    if (size && (nmemb > ((size_t) -1 / size)))
+        return NULL;
+    ptr = arena_alloc(nmemb * size);
+    if (ptr)
+        memset(ptr, 0, nmemb * size);
+    return ptr;
+}
+
+void
+arena_free(void *ptr)
+{
+    arena_region_t *region, **prev;
+    uint8_t        *base;
+
+    if (!ptr)
+        return;
+
+    /* Find the region containing this allocation. */
+    for (prev = &arena_regions; (region = *prev); prev = &region->next) {
+        base = (uint8_t *) region + ARENA_HEADER;
+        if (((uint8_t *) ptr > base) && ((uint8_t *) ptr < (base + region->used)))
+            break;
+    }
+    if (!region)
+        return;
+
+    /* Give the space back if this is the most recent allocation. Otherwise,
+       the space is only reclaimed when the arena is reset. */
+    ptr = (uint8_t *) ptr - ARENA_PREFIX;
+    if (((uint8_t *) ptr + *((size_t *) ptr)) == (base + region->used))
+        region->used = (uint8_t *) ptr - base;
+
+    /* Release regions left empty, other than the one being filled. */
+    if (!region->used && (region != arena_regions)) {
+        *prev = region->next;
+        arena_region_release(region);
+    }
+}
+
+void
+arena_reset(void)
+{
+    arena_region_t *region;
+
+    while ((region = arena_regions)) {
+        arena_regions = region->next;
+        arena_region_release(region);
+    }
+}
+#else
+/* On hosted and real mode targets, the C library's allocator is used directly,
+   and whatever is left allocated is reclaimed by the operating system on exit. */
+void *
+arena_alloc(size_t size)
+{
+    return malloc(size);
+}
+
+void *
+arena_calloc(size_t nmemb, size_t size)
+{
+    return calloc(nmemb, size);
+}
+
+void
+arena_free(void *ptr)
+{
+    free(ptr);
+}
+
+void
+arena_reset(void)
+{
+}
+#endif
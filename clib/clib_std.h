@@ -18,6 +18,9 @@
 #ifndef CLIB_STD_H
 #define CLIB_STD_H
 #include "clib.h"
+#ifndef __POSIX_UEFI__
+#    include <stddef.h>
+#endif
 
 /* String functions. */
 extern int parse_hex_u8(char *val, uint8_t *dest);
@@ -27,4 +30,10 @@ extern int parse_hex_u32(char *val, uint32_t *dest);
 /* Comparator functions. */
 extern int comp_ui8(const void *elem1, const void *elem2);
 
+/* Memory functions. */
+extern void *arena_alloc(size_t size);
+extern void *arena_calloc(size_t nmemb, size_t size);
+extern void  arena_free(void *ptr);
+extern void  arena_reset(void);
+
 #endif
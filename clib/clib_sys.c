@@ -23,6 +23,17 @@
 #elif defined(__GNUC__) && !defined(__POSIX_UEFI__)
 #    include <unistd.h>
 #endif
+#if defined(__WATCOMC__) && (defined(__DOS__) || defined(__PMODEW__))
+#    include <i86.h>
+#    define TIMER_PIT 1
+#    ifdef M_I386
+#        define BIOS_TICKS (*((volatile uint32_t *) 0x0046c))
+#    else
+#        define BIOS_TICKS (*((volatile uint32_t far *) MK_FP(0x0040, 0x006c)))
+#    endif
+#elif !defined(_WIN32) && !defined(__POSIX_UEFI__)
+#    include <time.h>
+#endif
 
 /* Interrupt functions. */
 #ifdef __WATCOMC__
@@ -64,6 +75,150 @@ delay(unsigned int ms)
 }
 #endif
 
+#if defined(TIMER_PIT)
+static uint32_t timer_last_ticks = 0, timer_ticks_base = 0;
+#elif defined(_WIN32)
+static LARGE_INTEGER timer_freq = { 0 };
+#elif defined(__POSIX_UEFI__)
+static uint64_t timer_freq = 0; /* counter ticks per second */
+
+static uint64_t
+timer_counter()
+{
+    uint64_t ret;
+#    ifdef __aarch64__
+    __asm__ __volatile__("mrs %0, cntvct_el0"
+                         : "=r"(ret));
+#    else
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc"
+                         : "=a"(lo), "=d"(hi));
+    ret = ((uint64_t) hi << 32) | lo;
+#    endif
+    return ret;
+}
+
+static void
+timer_calibrate()
+{
+#    ifdef __aarch64__
+    /* The generic timer's frequency is provided by the firmware. */
+    __asm__ __volatile__("mrs %0, cntfrq_el0"
+                         : "=r"(timer_freq));
+#    else
+    uint64_t start;
+
+    /* Calibrate the time stamp counter against the firmware's delay. */
+    start = timer_counter();
+    BS->Stall(10000);
+    timer_freq = (timer_counter() - start) * 100;
+#    endif
+    if (!timer_freq)
+        timer_freq = 1000000;
+}
+#endif
+
+uint32_t
+timer_now()
+{
+    /* Return a free-running clock value for timer_elapsed_us. */
+#if defined(TIMER_PIT)
+    /* PIT clocks since midnight, made of the BIOS tick count and
+       the position of PIT counter 0 within the current tick. */
+    uint32_t ticks;
+    uint16_t count;
+    uint8_t  status;
+
+    do {
+        ticks = BIOS_TICKS;
+        cli();
+        outb(0x43, 0xc2); /* read back status and count of counter 0 */
+        status = inb(0x40);
+        count  = inb(0x40);
+        count |= inb(0x40) << 8;
+        sti();
+    } while (ticks != BIOS_TICKS); /* retry if the tick count moved on in the meantime */
+
+    /* The tick count goes back to 0 at midnight, after 0x1800B0 ticks. Keep
+       counting up from there, so that waits crossing midnight still work. */
+    if (ticks < timer_last_ticks)
+        timer_ticks_base += 0x1800b0;
+    timer_last_ticks = ticks;
+    ticks += timer_ticks_base;
+
+    /* In mode 3 (square wave), the counter runs down twice per tick at
+       double speed, and a low output means it's on the second run. */
+    count = -count;
+    if (((status >> 1) & 3) == 3) {
+        count >>= 1;
+        if (!(status & 0x80))
+            count |= 0x8000;
+    }
+    return (ticks << 16) | count;
+#elif defined(_WIN32)
+    LARGE_INTEGER count;
+
+    QueryPerformanceCounter(&count);
+    return count.LowPart;
+#elif defined(__POSIX_UEFI__)
+    /* Microseconds from the CPU's time stamp counter or ARM generic timer,
+       converted in two halves so that the multiplication can't overflow. */
+    uint64_t count;
+
+    if (!timer_freq)
+        timer_calibrate();
+    count = timer_counter();
+    return ((count / timer_freq) * 1000000) + (((count % timer_freq) * 1000000) / timer_freq);
+#else
+    /* Microseconds. */
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint32_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#endif
+}
+
+uint32_t
+timer_elapsed_us(uint32_t since)
+{
+    uint32_t elapsed = timer_now() - since;
+
+#if defined(TIMER_PIT)
+    /* Convert PIT clocks to microseconds, multiplying by 65536 / 1.193182 in
+       two halves so that it fits in 32 bits. */
+    return ((elapsed >> 16) * 54925) + (((elapsed & 0xffff) * 54925) >> 16);
+#elif defined(_WIN32)
+    if (!timer_freq.QuadPart)
+        QueryPerformanceFrequency(&timer_freq);
+    return ((uint64_t) elapsed * 1000000) / timer_freq.QuadPart;
+#else
+    return elapsed;
+#endif
+}
+
+void
+deadline_start(deadline_t *dl, uint32_t timeout_us)
+{
+    dl->start   = timer_now();
+    dl->timeout = timeout_us;
+    dl->elapsed = 0;
+}
+
+int
+deadline_passed(deadline_t *dl)
+{
+    /* Record how long it has been, so that callers can report how long a wait took. */
+    dl->elapsed = timer_elapsed_us(dl->start);
+    return dl->elapsed >= dl->timeout;
+}
+
+uint32_t
+deadline_stop(deadline_t *dl)
+{
+    /* Record the final elapsed time of a wait which finished before its deadline. */
+    return dl->elapsed = timer_elapsed_us(dl->start);
+}
+
 /* Port I/O functions. */
 #ifdef __WATCOMC__
 /* Defined in header. */
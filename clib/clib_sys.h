@@ -31,9 +31,18 @@ extern void     sti();
 #endif
 
 /* Time functions. */
+typedef struct {
+    uint32_t start, timeout, elapsed; /* elapsed is updated by deadline_passed */
+} deadline_t;
+
 #ifndef __WATCOMC__
 extern void     delay(unsigned int ms);
 #endif
+extern uint32_t timer_now();
+extern uint32_t timer_elapsed_us(uint32_t since);
+extern void     deadline_start(deadline_t *dl, uint32_t timeout_us);
+extern int      deadline_passed(deadline_t *dl);
+extern uint32_t deadline_stop(deadline_t *dl);
 
 /* Port I/O functions. */
 #ifdef __WATCOMC__
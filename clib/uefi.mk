@@ -19,7 +19,7 @@ VPATH		= . ../clib
 
 export TARGET	= $(DEST)
 export SRCS	= $(OBJS:.o=.c)
-export CFLAGS	= -mno-sse -D__POSIX_UEFI__ -I../clib
+export CFLAGS	+= -mno-sse -D__POSIX_UEFI__ -I../clib
 export USE_GCC	= 1
 
 include uefi/Makefile
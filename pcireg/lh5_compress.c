@@ -0,0 +1,725 @@
+/*
+ * 86Box	A hypervisor and IBM PC system emulator that specializes in
+ *		running old operating systems and software designed for IBM
+ *		PC systems and compatibles from 1981 through fairly recent
+ *		system designs based on the PCI bus.
+ *
+ *		This file is part of the 86Box Probing Tools distribution.
+ *
+ *		LH5/LH6/LH7 compressor, producing archives readable by
+ *		lh5_extract.c and lha. Runs on the build host.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "lh5_compress.h"
+#include "lh5_extract.h"
+
+#define MAXMATCH	LH5_MAXMATCH
+#define THRESHOLD	LH5_THRESHOLD
+#define NC		LH5_NC
+#define NT		LH5_NT
+#define MAX_NP		(LH5_MAX_DICBIT + 1)
+#define NPT		LH5_NPT
+#define CBIT		9	/* smallest integer such that (1 << CBIT) > NC */
+#define TBIT		5	/* smallest integer such that (1 << TBIT) > NT */
+
+#define HASH_BITS	15
+#define HASH_SIZE	(1 << HASH_BITS)
+#define MAX_CHAIN	4096	/* hash chain entries looked at per position */
+#define BLOCK_CODES	16384	/* codes per block, must fit in 16 bits */
+#define OPTIMAL_PASSES	2	/* parses refining the code length estimates */
+
+/*
+ * Dictionary size and position codes of the method being written.
+ */
+static int dicsiz, np, pbit;
+
+/*
+ * Bit output.
+ */
+static unsigned char *out_buf;
+static int out_size, out_pos, out_overflow;
+static unsigned int out_bits;
+static int out_count;
+
+static void putbits(int n, unsigned int x)
+{				/* write the rightmost n bits of x, MSB first */
+	out_bits = (out_bits << n) | (x & ((1U << n) - 1));
+	out_count += n;
+	while (out_count >= 8) {
+		out_count -= 8;
+		if (out_pos < out_size)
+			out_buf[out_pos++] = out_bits >> out_count;
+		else
+			out_overflow = 1;
+	}
+}
+
+static void flushbits(void)
+{
+	if (out_count)
+		putbits(8 - out_count, 0);
+}
+
+/*
+ * Huffman code construction.
+ */
+static void make_len(int n, unsigned int freq[], unsigned char len[])
+{
+	int heap[NC + 1], parent[2 * NC], sym[NC];
+	unsigned int weight[2 * NC];
+	unsigned short count[17];
+	int i, j, k, a, b, c, top, used, nodes, size, depth;
+	unsigned int cum;
+
+	memset(len, 0, n);
+
+	/* build a min-heap of used symbols */
+	size = 0;
+	for (i = 0; i < n; i++) {
+		weight[i] = freq[i];
+		if (!freq[i])
+			continue;
+		j = ++size;
+		while ((j > 1) && (weight[heap[j / 2]] > weight[i])) {
+			heap[j] = heap[j / 2];
+			j /= 2;
+		}
+		heap[j] = i;
+	}
+	used = size;
+	if (used < 2)
+		return;
+
+	/* combine the two lightest nodes until one remains */
+	nodes = n;
+	a = b = 0;
+	while (size > 1) {
+		for (k = 0; k < 2; k++) {
+			top = heap[1];
+			heap[1] = heap[size--];
+			j = 1;
+			while ((2 * j) <= size) {
+				c = 2 * j;
+				if ((c < size) && (weight[heap[c + 1]] < weight[heap[c]]))
+					c++;
+				if (weight[heap[j]] <= weight[heap[c]])
+					break;
+				i = heap[j];
+				heap[j] = heap[c];
+				heap[c] = i;
+				j = c;
+			}
+			if (k == 0)
+				a = top;
+			else
+				b = top;
+		}
+		weight[nodes] = weight[a] + weight[b];
+		parent[a] = parent[b] = nodes;
+		j = ++size;
+		while ((j > 1) && (weight[heap[j / 2]] > weight[nodes])) {
+			heap[j] = heap[j / 2];
+			j /= 2;
+		}
+		heap[j] = nodes++;
+	}
+
+	/* derive code lengths, clamping them to 16 bits */
+	memset(count, 0, sizeof(count));
+	parent[nodes - 1] = -1;
+	k = 0;
+	for (i = 0; i < n; i++) {
+		if (!freq[i])
+			continue;
+		depth = 0;
+		for (j = i; parent[j] >= 0; j = parent[j])
+			depth++;
+		count[(depth > 16) ? 16 : depth]++;
+		sym[k++] = i;
+	}
+
+	/* restore the Kraft sum after clamping, as lha's make_len does */
+	cum = 0;
+	for (i = 16; i > 0; i--)
+		cum += count[i] << (16 - i);
+	while (cum != 0x10000) {
+		count[16]--;
+		for (i = 15; i > 0; i--) {
+			if (count[i]) {
+				count[i]--;
+				count[i + 1] += 2;
+				break;
+			}
+		}
+		cum--;
+	}
+
+	/* hand out the lengths, shortest to the most frequent symbols */
+	for (i = 1; i < used; i++) {
+		a = sym[i];
+		for (j = i; (j > 0) && (freq[sym[j - 1]] < freq[a]); j--)
+			sym[j] = sym[j - 1];
+		sym[j] = a;
+	}
+	k = 0;
+	for (i = 1; i <= 16; i++)
+		for (j = count[i]; j > 0; j--)
+			len[sym[k++]] = i;
+}
+
+static void make_code(int n, unsigned char len[], unsigned short code[])
+{				/* canonical codes, as assigned by make_table */
+	unsigned short start[18];
+	int i, j, count;
+
+	start[1] = 0;
+	for (i = 1; i <= 16; i++) {
+		count = 0;
+		for (j = 0; j < n; j++)
+			count += (len[j] == i);
+		start[i + 1] = (start[i] + count) << 1;
+	}
+	for (i = 0; i < n; i++)
+		code[i] = len[i] ? start[len[i]]++ : 0;
+}
+
+static int bit_length(unsigned int x)
+{
+	int n = 0;
+
+	while (x) {
+		n++;
+		x >>= 1;
+	}
+	return n;
+}
+
+static int single_symbol(int n, unsigned int freq[], int *symbol)
+{
+	int i, used = 0;
+
+	*symbol = 0;
+	for (i = 0; i < n; i++) {
+		if (freq[i]) {
+			used++;
+			*symbol = i;
+		}
+	}
+	return used < 2;
+}
+
+/*
+ * Block output.
+ */
+static unsigned short blk_c[BLOCK_CODES], blk_p[BLOCK_CODES];
+static int blk_n;
+
+static unsigned char c_len[NC], pt_len[NPT];
+static unsigned short c_code[NC], pt_code[NPT];
+
+static void write_pt_len(int n, int nbit, int i_special)
+{
+	int i, k;
+
+	while ((n > 0) && (pt_len[n - 1] == 0))
+		n--;
+	putbits(nbit, n);
+	i = 0;
+	while (i < n) {
+		k = pt_len[i++];
+		if (k <= 6)
+			putbits(3, k);
+		else
+			putbits(k - 3, 0xfffe);
+		if (i == i_special) {
+			while ((i < 6) && (pt_len[i] == 0))
+				i++;
+			putbits(2, i - 3);
+		}
+	}
+}
+
+static void count_t_freq(unsigned int t_freq[])
+{
+	int i, k, n, count;
+
+	memset(t_freq, 0, NT * sizeof(t_freq[0]));
+	n = NC;
+	while ((n > 0) && (c_len[n - 1] == 0))
+		n--;
+	i = 0;
+	while (i < n) {
+		k = c_len[i++];
+		if (k == 0) {
+			count = 1;
+			while ((i < n) && (c_len[i] == 0)) {
+				i++;
+				count++;
+			}
+			if (count <= 2) {
+				t_freq[0] += count;
+			} else if (count <= 18) {
+				t_freq[1]++;
+			} else if (count == 19) {
+				t_freq[0]++;
+				t_freq[1]++;
+			} else {
+				t_freq[2]++;
+			}
+		} else {
+			t_freq[k + 2]++;
+		}
+	}
+}
+
+static void write_c_len(void)
+{
+	int i, k, n, count;
+
+	n = NC;
+	while ((n > 0) && (c_len[n - 1] == 0))
+		n--;
+	putbits(CBIT, n);
+	i = 0;
+	while (i < n) {
+		k = c_len[i++];
+		if (k == 0) {
+			count = 1;
+			while ((i < n) && (c_len[i] == 0)) {
+				i++;
+				count++;
+			}
+			if (count <= 2) {
+				for (k = 0; k < count; k++)
+					putbits(pt_len[0], pt_code[0]);
+			} else if (count <= 18) {
+				putbits(pt_len[1], pt_code[1]);
+				putbits(4, count - 3);
+			} else if (count == 19) {
+				putbits(pt_len[0], pt_code[0]);
+				putbits(pt_len[1], pt_code[1]);
+				putbits(4, 15);
+			} else {
+				putbits(pt_len[2], pt_code[2]);
+				putbits(CBIT, count - 20);
+			}
+		} else {
+			putbits(pt_len[k + 2], pt_code[k + 2]);
+		}
+	}
+}
+
+static void flush_block(void)
+{
+	unsigned int c_freq[NC], t_freq[NT], p_freq[MAX_NP];
+	unsigned char p_len[MAX_NP];
+	unsigned short p_code[MAX_NP];
+	int i, c, symbol;
+
+	if (!blk_n)
+		return;
+
+	memset(c_freq, 0, sizeof(c_freq));
+	memset(p_freq, 0, sizeof(p_freq));
+	for (i = 0; i < blk_n; i++) {
+		c_freq[blk_c[i]]++;
+		if (blk_c[i] >= 256)
+			p_freq[bit_length(blk_p[i])]++;
+	}
+
+	putbits(16, blk_n);
+
+	/* character/length tree, described through the T tree */
+	if (single_symbol(NC, c_freq, &symbol)) {
+		putbits(TBIT, 0);
+		putbits(TBIT, 0);
+		putbits(CBIT, 0);
+		putbits(CBIT, symbol);
+		memset(c_len, 0, sizeof(c_len));
+		c_code[symbol] = 0;
+	} else {
+		make_len(NC, c_freq, c_len);
+		make_code(NC, c_len, c_code);
+		count_t_freq(t_freq);
+		if (single_symbol(NT, t_freq, &symbol)) {
+			putbits(TBIT, 0);
+			putbits(TBIT, symbol);
+			memset(pt_len, 0, sizeof(pt_len));
+			pt_code[symbol] = 0;
+		} else {
+			make_len(NT, t_freq, pt_len);
+			make_code(NT, pt_len, pt_code);
+			write_pt_len(NT, TBIT, 3);
+		}
+		write_c_len();
+	}
+
+	/* position tree */
+	if (single_symbol(np, p_freq, &symbol)) {
+		putbits(pbit, 0);
+		putbits(pbit, symbol);
+		memset(p_len, 0, sizeof(p_len));
+		p_code[symbol] = 0;
+	} else {
+		make_len(np, p_freq, p_len);
+		make_code(np, p_len, p_code);
+		memcpy(pt_len, p_len, np);
+		write_pt_len(np, pbit, -1);
+	}
+
+	/* codes */
+	for (i = 0; i < blk_n; i++) {
+		c = blk_c[i];
+		putbits(c_len[c], c_code[c]);
+		if (c >= 256) {
+			symbol = bit_length(blk_p[i]);
+			putbits(p_len[symbol], p_code[symbol]);
+			if (symbol > 1)
+				putbits(symbol - 1, blk_p[i]);
+		}
+	}
+
+	blk_n = 0;
+}
+
+static void output(int c, int p)
+{
+	blk_c[blk_n] = c;
+	blk_p[blk_n] = p;
+	if (++blk_n == BLOCK_CODES)
+		flush_block();
+}
+
+/*
+ * Match finding.
+ *
+ * Positions are chained by a hash of their first THRESHOLD bytes. The
+ * chains are walked from the closest position, so every longer match found
+ * along the way is the closest one of its length.
+ */
+static int head[HASH_SIZE], prev[1 << LH5_MAX_DICBIT];
+static int match_len[MAXMATCH], match_pos[MAXMATCH];
+
+static unsigned int hash3(unsigned char *p)
+{
+	return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (HASH_SIZE - 1);
+}
+
+static void insert(unsigned char *in, int size, int pos)
+{
+	unsigned int h;
+
+	if ((pos + THRESHOLD) > size)
+		return;
+	h = hash3(&in[pos]);
+	prev[pos & (dicsiz - 1)] = head[h];
+	head[h] = pos;
+}
+
+/* Find the closest match of each length up to the longest one. */
+static int find_matches(unsigned char *in, int size, int pos)
+{
+	int cand, len, best = 0, limit, chain = MAX_CHAIN, n = 0;
+
+	if ((pos + THRESHOLD) > size)
+		return 0;
+	limit = size - pos;
+	if (limit > MAXMATCH)
+		limit = MAXMATCH;
+
+	cand = head[hash3(&in[pos])];
+	while ((cand >= 0) && ((pos - cand) < dicsiz) && chain--) {
+		if (in[cand + best] == in[pos + best]) {
+			for (len = 0; (len < limit) && (in[cand + len] == in[pos + len]); len++)
+				;
+			if (len > best) {
+				best = len;
+				if (len >= THRESHOLD) {
+					match_len[n] = len;
+					match_pos[n++] = cand;
+				}
+				if (len == limit)
+					break;
+			}
+		}
+		cand = prev[cand & (dicsiz - 1)];
+		if (cand >= pos)	/* slot was reused by a newer position */
+			break;
+	}
+	return n;
+}
+
+static void init_matches(void)
+{
+	int i;
+
+	for (i = 0; i < HASH_SIZE; i++)
+		head[i] = -1;
+}
+
+/*
+ * Lazy parsing: take the longest match, unless the next position has a
+ * longer one.
+ */
+static void parse_lazy(unsigned char *in, int size)
+{
+	int pos, len, dist, next, i;
+
+	init_matches();
+	pos = 0;
+	while (pos < size) {
+		next = find_matches(in, size, pos);
+		insert(in, size, pos);
+		if (!next) {
+			output(in[pos++], 0);
+			continue;
+		}
+		len = match_len[next - 1];
+		dist = pos - match_pos[next - 1] - 1;
+
+		next = find_matches(in, size, pos + 1);
+		if (next && (match_len[next - 1] > len)) {
+			output(in[pos++], 0);
+			continue;
+		}
+
+		output(256 + len - THRESHOLD, dist);
+		for (i = 1; i < len; i++)
+			insert(in, size, pos + i);
+		pos += len;
+	}
+}
+
+/*
+ * Optimal parsing: find the cheapest path through all matches, with costs
+ * taken from the code lengths of the previous parse. The first parse has no
+ * previous one, so it starts from a greedy parse's statistics.
+ */
+static unsigned int *cost;
+static unsigned short *path_len, *path_dist;
+static unsigned int cost_c[NC], cost_p[MAX_NP];
+
+static void count_costs(unsigned char *in, int size, int greedy)
+{
+	unsigned int c_freq[NC], p_freq[MAX_NP];
+	unsigned char len[NC];
+	int pos, i, c, dist;
+
+	memset(c_freq, 0, sizeof(c_freq));
+	memset(p_freq, 0, sizeof(p_freq));
+
+	if (greedy) {
+		/* take the longest match everywhere */
+		init_matches();
+		for (pos = 0; pos < size;) {
+			i = find_matches(in, size, pos);
+			insert(in, size, pos);
+			if (!i) {
+				c_freq[in[pos++]]++;
+				continue;
+			}
+			c = match_len[i - 1];
+			dist = pos - match_pos[i - 1] - 1;
+			c_freq[256 + c - THRESHOLD]++;
+			p_freq[bit_length(dist)]++;
+			for (i = 1; i < c; i++)
+				insert(in, size, pos + i);
+			pos += c;
+		}
+	} else {
+		/* follow the previous optimal parse */
+		for (pos = size; pos > 0; pos -= path_len[pos]) {
+			if (path_len[pos] == 1) {
+				c_freq[in[pos - 1]]++;
+			} else {
+				c_freq[256 + path_len[pos] - THRESHOLD]++;
+				p_freq[bit_length(path_dist[pos])]++;
+			}
+		}
+	}
+
+	/* unused symbols are given some count, so that they don't cost nothing */
+	for (i = 0; i < NC; i++)
+		c_freq[i] = (c_freq[i] << 2) + 1;
+	for (i = 0; i < np; i++)
+		p_freq[i] = (p_freq[i] << 2) + 1;
+
+	make_len(NC, c_freq, len);
+	for (i = 0; i < NC; i++)
+		cost_c[i] = len[i];
+	make_len(np, p_freq, len);
+	for (i = 0; i < np; i++)
+		cost_p[i] = len[i] + ((i > 1) ? (i - 1) : 0);
+}
+
+static void parse_optimal(unsigned char *in, int size)
+{
+	unsigned int c;
+	int pos, i, n, len, prev_len, dist;
+
+	for (i = 0; i <= size; i++)
+		cost[i] = 0xffffffff;
+	cost[0] = 0;
+
+	init_matches();
+	for (pos = 0; pos < size; pos++) {
+		/* literal */
+		c = cost[pos] + cost_c[in[pos]];
+		if (c < cost[pos + 1]) {
+			cost[pos + 1] = c;
+			path_len[pos + 1] = 1;
+		}
+
+		/* matches of every length, each from its closest position */
+		n = find_matches(in, size, pos);
+		insert(in, size, pos);
+		prev_len = THRESHOLD - 1;
+		for (i = 0; i < n; i++) {
+			dist = pos - match_pos[i] - 1;
+			for (len = prev_len + 1; len <= match_len[i]; len++) {
+				c = cost[pos] + cost_c[256 + len - THRESHOLD] + cost_p[bit_length(dist)];
+				if (c < cost[pos + len]) {
+					cost[pos + len] = c;
+					path_len[pos + len] = len;
+					path_dist[pos + len] = dist;
+				}
+			}
+			prev_len = match_len[i];
+		}
+	}
+}
+
+static void output_optimal(unsigned char *in, int size)
+{
+	int pos, i;
+
+	/* reverse the path, which is stored from its end, reusing cost[] */
+	i = 0;
+	for (pos = size; pos > 0; pos -= path_len[pos])
+		cost[i++] = pos;
+	while (i--) {
+		pos = cost[i];
+		if (path_len[pos] == 1)
+			output(in[pos - 1], 0);
+		else
+			output(256 + path_len[pos] - THRESHOLD, path_dist[pos]);
+	}
+}
+
+/*
+ * Compress InputBuffer into PackedBuffer with method '5', '6' or '7', with
+ * optimal parsing if requested or lazy parsing otherwise. Returns the packed
+ * size, or -1 if it did not fit, memory ran out or the method is unknown.
+ */
+int
+LH5Encode(unsigned char *InputBuffer, int InputBufferSize,
+	  unsigned char *PackedBuffer, int PackedBufferSize,
+	  int optimal, unsigned char method)
+{
+	int pass;
+
+	switch (method) {
+	case '5':
+		np = LH5_DICBIT + 1;
+		pbit = 4;
+		break;
+	case '6':
+		np = LH6_DICBIT + 1;
+		pbit = 5;
+		break;
+	case '7':
+		np = LH7_DICBIT + 1;
+		pbit = 5;
+		break;
+	default:
+		return -1;
+	}
+	dicsiz = 1 << (np - 1);
+
+	out_buf = PackedBuffer;
+	out_size = PackedBufferSize;
+	out_pos = out_overflow = 0;
+	out_bits = out_count = 0;
+	blk_n = 0;
+
+	if (optimal) {
+		cost = malloc((InputBufferSize + 1) * sizeof(cost[0]));
+		path_len = malloc((InputBufferSize + 1) * sizeof(path_len[0]));
+		path_dist = malloc((InputBufferSize + 1) * sizeof(path_dist[0]));
+		if (!cost || !path_len || !path_dist) {
+			free(cost);
+			free(path_len);
+			free(path_dist);
+			return -1;
+		}
+
+		for (pass = 0; pass < OPTIMAL_PASSES; pass++) {
+			count_costs(InputBuffer, InputBufferSize, pass == 0);
+			parse_optimal(InputBuffer, InputBufferSize);
+		}
+		output_optimal(InputBuffer, InputBufferSize);
+
+		free(cost);
+		free(path_len);
+		free(path_dist);
+	} else {
+		parse_lazy(InputBuffer, InputBufferSize);
+	}
+	flush_block();
+	flushbits();
+
+	return out_overflow ? -1 : out_pos;
+}
+
+/*
+ * Write a level 1 header, as laid out in lh5_extract.c, without extended
+ * headers. time is in MS-DOS format. Returns the header size, or 0 if it
+ * did not fit.
+ */
+static void put16(unsigned char *p, unsigned int x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+}
+
+static void put32(unsigned char *p, unsigned long x)
+{
+	put16(p, x);
+	put16(p + 2, x >> 16);
+}
+
+int
+LH5HeaderWrite(unsigned char *Buffer, int BufferSize, char *name,
+	       unsigned int original_size, unsigned int packed_size,
+	       unsigned short crc, unsigned char method, unsigned long time)
+{
+	int i, sum, name_length = strlen(name);
+
+	if ((name_length > 230) || (BufferSize < (name_length + 27)))
+		return 0;
+
+	Buffer[0] = name_length + 25;
+	memcpy(Buffer + 2, "-lh -", 5);
+	Buffer[5] = method;
+	put32(Buffer + 7, packed_size);
+	put32(Buffer + 11, original_size);
+	put32(Buffer + 15, time);
+	Buffer[19] = 0x20;
+	Buffer[20] = 1;
+	Buffer[21] = name_length;
+	memcpy(Buffer + 22, name, name_length);
+	put16(Buffer + 22 + name_length, crc);
+	Buffer[24 + name_length] = 'M';
+	put16(Buffer + 25 + name_length, 0);
+
+	sum = 0;
+	for (i = 2; i < (name_length + 27); i++)
+		sum += Buffer[i];
+	Buffer[1] = sum;
+
+	return name_length + 27;
+}
@@ -0,0 +1,25 @@
+/*
+ * 86Box	A hypervisor and IBM PC system emulator that specializes in
+ *		running old operating systems and software designed for IBM
+ *		PC systems and compatibles from 1981 through fairly recent
+ *		system designs based on the PCI bus.
+ *
+ *		This file is part of the 86Box Probing Tools distribution.
+ *
+ *		Definitions for the LH5 compressor.
+ *
+ */
+
+#ifndef LH5_COMPRESS_H
+#define LH5_COMPRESS_H
+
+int LH5Encode(unsigned char *InputBuffer, int InputBufferSize,
+	      unsigned char *PackedBuffer, int PackedBufferSize,
+	      int optimal, unsigned char method);
+
+int LH5HeaderWrite(unsigned char *Buffer, int BufferSize, char *name,
+		   unsigned int original_size, unsigned int packed_size,
+		   unsigned short crc, unsigned char method,
+		   unsigned long time);
+
+#endif				/* LH5_COMPRESS_H */
@@ -107,7 +107,7 @@ LH5HeaderParse(unsigned char *Buffer, int BufferSize,
 
 	/* check method */
 	*method = Buffer[5];
-	if (Buffer[2] != '-' || Buffer[3] != 'l' || Buffer[4] != 'h' || (*method != '0' && *method != '5') || Buffer[6] != '-') {
+	if (Buffer[2] != '-' || Buffer[3] != 'l' || Buffer[4] != 'h' || (*method != '0' && (*method < '5' || *method > '7')) || Buffer[6] != '-') {
 		fprintf(stderr, "Error: Compression method %c is not supported.\n", *method);
 		return 0;
 	}
@@ -135,7 +135,13 @@ LH5HeaderParse(unsigned char *Buffer, int BufferSize,
 	*packed_size = le32toh(*(unsigned int *)(Buffer + 7));
 	*original_size = le32toh(*(unsigned int *)(Buffer + 11));
 
+	/* the name and CRC must be within the header */
 	name_length = Buffer[21];
+	if ((name_length + 22) > header_size) {
+		fprintf(stderr, "Error: File name is longer than the lha header.\n");
+		return 0;
+	}
+
 	*name = malloc(name_length + 1);
 	if (*name) {
 		memcpy(*name, (char *)Buffer + 22, name_length);
@@ -172,89 +178,262 @@ LH5HeaderParse(unsigned char *Buffer, int BufferSize,
  */
 #define CRCPOLY 0xA001		/* CRC-16 (x^16+x^15+x^2+1) */
 
-unsigned short CRC16Calculate(unsigned char *Buffer, int BufferSize)
-{
-	unsigned short CRCTable[0x100];
-	unsigned short crc;
-	int i;
+#define UPDATE_CRC(crc, c) (CRCTable[0][((crc) ^ (c)) & 0xFF] ^ ((crc) >> 8))
 
-	/* First, initialise our CRCTable */
-	for (i = 0; i < 0x100; i++) {
-		unsigned short r = i;
-		unsigned int j;
+/*
+ * Precalculated from CRCPOLY, so that no state needs to be initialised.
+ * CRCTable[n] is the CRC of a byte followed by n zero bytes, which lets
+ * crc16_update() go over 4 bytes at a time.
+ */
+static const unsigned short CRCTable[4][0x100] = {
+	{
+		0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+		0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+		0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+		0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+		0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+		0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+		0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+		0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+		0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+		0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+		0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+		0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+		0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+		0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+		0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+		0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+		0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+		0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+		0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+		0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+		0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+		0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+		0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+		0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+		0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+		0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+		0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+		0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+		0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+		0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+		0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+		0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040,
+	},
+	{
+		0x0000, 0x9001, 0x6001, 0xF000, 0xC002, 0x5003, 0xA003, 0x3002,
+		0xC007, 0x5006, 0xA006, 0x3007, 0x0005, 0x9004, 0x6004, 0xF005,
+		0xC00D, 0x500C, 0xA00C, 0x300D, 0x000F, 0x900E, 0x600E, 0xF00F,
+		0x000A, 0x900B, 0x600B, 0xF00A, 0xC008, 0x5009, 0xA009, 0x3008,
+		0xC019, 0x5018, 0xA018, 0x3019, 0x001B, 0x901A, 0x601A, 0xF01B,
+		0x001E, 0x901F, 0x601F, 0xF01E, 0xC01C, 0x501D, 0xA01D, 0x301C,
+		0x0014, 0x9015, 0x6015, 0xF014, 0xC016, 0x5017, 0xA017, 0x3016,
+		0xC013, 0x5012, 0xA012, 0x3013, 0x0011, 0x9010, 0x6010, 0xF011,
+		0xC031, 0x5030, 0xA030, 0x3031, 0x0033, 0x9032, 0x6032, 0xF033,
+		0x0036, 0x9037, 0x6037, 0xF036, 0xC034, 0x5035, 0xA035, 0x3034,
+		0x003C, 0x903D, 0x603D, 0xF03C, 0xC03E, 0x503F, 0xA03F, 0x303E,
+		0xC03B, 0x503A, 0xA03A, 0x303B, 0x0039, 0x9038, 0x6038, 0xF039,
+		0x0028, 0x9029, 0x6029, 0xF028, 0xC02A, 0x502B, 0xA02B, 0x302A,
+		0xC02F, 0x502E, 0xA02E, 0x302F, 0x002D, 0x902C, 0x602C, 0xF02D,
+		0xC025, 0x5024, 0xA024, 0x3025, 0x0027, 0x9026, 0x6026, 0xF027,
+		0x0022, 0x9023, 0x6023, 0xF022, 0xC020, 0x5021, 0xA021, 0x3020,
+		0xC061, 0x5060, 0xA060, 0x3061, 0x0063, 0x9062, 0x6062, 0xF063,
+		0x0066, 0x9067, 0x6067, 0xF066, 0xC064, 0x5065, 0xA065, 0x3064,
+		0x006C, 0x906D, 0x606D, 0xF06C, 0xC06E, 0x506F, 0xA06F, 0x306E,
+		0xC06B, 0x506A, 0xA06A, 0x306B, 0x0069, 0x9068, 0x6068, 0xF069,
+		0x0078, 0x9079, 0x6079, 0xF078, 0xC07A, 0x507B, 0xA07B, 0x307A,
+		0xC07F, 0x507E, 0xA07E, 0x307F, 0x007D, 0x907C, 0x607C, 0xF07D,
+		0xC075, 0x5074, 0xA074, 0x3075, 0x0077, 0x9076, 0x6076, 0xF077,
+		0x0072, 0x9073, 0x6073, 0xF072, 0xC070, 0x5071, 0xA071, 0x3070,
+		0x0050, 0x9051, 0x6051, 0xF050, 0xC052, 0x5053, 0xA053, 0x3052,
+		0xC057, 0x5056, 0xA056, 0x3057, 0x0055, 0x9054, 0x6054, 0xF055,
+		0xC05D, 0x505C, 0xA05C, 0x305D, 0x005F, 0x905E, 0x605E, 0xF05F,
+		0x005A, 0x905B, 0x605B, 0xF05A, 0xC058, 0x5059, 0xA059, 0x3058,
+		0xC049, 0x5048, 0xA048, 0x3049, 0x004B, 0x904A, 0x604A, 0xF04B,
+		0x004E, 0x904F, 0x604F, 0xF04E, 0xC04C, 0x504D, 0xA04D, 0x304C,
+		0x0044, 0x9045, 0x6045, 0xF044, 0xC046, 0x5047, 0xA047, 0x3046,
+		0xC043, 0x5042, 0xA042, 0x3043, 0x0041, 0x9040, 0x6040, 0xF041,
+	},
+	{
+		0x0000, 0xC051, 0xC0A1, 0x00F0, 0xC141, 0x0110, 0x01E0, 0xC1B1,
+		0xC281, 0x02D0, 0x0220, 0xC271, 0x03C0, 0xC391, 0xC361, 0x0330,
+		0xC501, 0x0550, 0x05A0, 0xC5F1, 0x0440, 0xC411, 0xC4E1, 0x04B0,
+		0x0780, 0xC7D1, 0xC721, 0x0770, 0xC6C1, 0x0690, 0x0660, 0xC631,
+		0xCA01, 0x0A50, 0x0AA0, 0xCAF1, 0x0B40, 0xCB11, 0xCBE1, 0x0BB0,
+		0x0880, 0xC8D1, 0xC821, 0x0870, 0xC9C1, 0x0990, 0x0960, 0xC931,
+		0x0F00, 0xCF51, 0xCFA1, 0x0FF0, 0xCE41, 0x0E10, 0x0EE0, 0xCEB1,
+		0xCD81, 0x0DD0, 0x0D20, 0xCD71, 0x0CC0, 0xCC91, 0xCC61, 0x0C30,
+		0xD401, 0x1450, 0x14A0, 0xD4F1, 0x1540, 0xD511, 0xD5E1, 0x15B0,
+		0x1680, 0xD6D1, 0xD621, 0x1670, 0xD7C1, 0x1790, 0x1760, 0xD731,
+		0x1100, 0xD151, 0xD1A1, 0x11F0, 0xD041, 0x1010, 0x10E0, 0xD0B1,
+		0xD381, 0x13D0, 0x1320, 0xD371, 0x12C0, 0xD291, 0xD261, 0x1230,
+		0x1E00, 0xDE51, 0xDEA1, 0x1EF0, 0xDF41, 0x1F10, 0x1FE0, 0xDFB1,
+		0xDC81, 0x1CD0, 0x1C20, 0xDC71, 0x1DC0, 0xDD91, 0xDD61, 0x1D30,
+		0xDB01, 0x1B50, 0x1BA0, 0xDBF1, 0x1A40, 0xDA11, 0xDAE1, 0x1AB0,
+		0x1980, 0xD9D1, 0xD921, 0x1970, 0xD8C1, 0x1890, 0x1860, 0xD831,
+		0xE801, 0x2850, 0x28A0, 0xE8F1, 0x2940, 0xE911, 0xE9E1, 0x29B0,
+		0x2A80, 0xEAD1, 0xEA21, 0x2A70, 0xEBC1, 0x2B90, 0x2B60, 0xEB31,
+		0x2D00, 0xED51, 0xEDA1, 0x2DF0, 0xEC41, 0x2C10, 0x2CE0, 0xECB1,
+		0xEF81, 0x2FD0, 0x2F20, 0xEF71, 0x2EC0, 0xEE91, 0xEE61, 0x2E30,
+		0x2200, 0xE251, 0xE2A1, 0x22F0, 0xE341, 0x2310, 0x23E0, 0xE3B1,
+		0xE081, 0x20D0, 0x2020, 0xE071, 0x21C0, 0xE191, 0xE161, 0x2130,
+		0xE701, 0x2750, 0x27A0, 0xE7F1, 0x2640, 0xE611, 0xE6E1, 0x26B0,
+		0x2580, 0xE5D1, 0xE521, 0x2570, 0xE4C1, 0x2490, 0x2460, 0xE431,
+		0x3C00, 0xFC51, 0xFCA1, 0x3CF0, 0xFD41, 0x3D10, 0x3DE0, 0xFDB1,
+		0xFE81, 0x3ED0, 0x3E20, 0xFE71, 0x3FC0, 0xFF91, 0xFF61, 0x3F30,
+		0xF901, 0x3950, 0x39A0, 0xF9F1, 0x3840, 0xF811, 0xF8E1, 0x38B0,
+		0x3B80, 0xFBD1, 0xFB21, 0x3B70, 0xFAC1, 0x3A90, 0x3A60, 0xFA31,
+		0xF601, 0x3650, 0x36A0, 0xF6F1, 0x3740, 0xF711, 0xF7E1, 0x37B0,
+		0x3480, 0xF4D1, 0xF421, 0x3470, 0xF5C1, 0x3590, 0x3560, 0xF531,
+		0x3300, 0xF351, 0xF3A1, 0x33F0, 0xF241, 0x3210, 0x32E0, 0xF2B1,
+		0xF181, 0x31D0, 0x3120, 0xF171, 0x30C0, 0xF091, 0xF061, 0x3030,
+	},
+	{
+		0x0000, 0xFC01, 0xB801, 0x4400, 0x3001, 0xCC00, 0x8800, 0x7401,
+		0x6002, 0x9C03, 0xD803, 0x2402, 0x5003, 0xAC02, 0xE802, 0x1403,
+		0xC004, 0x3C05, 0x7805, 0x8404, 0xF005, 0x0C04, 0x4804, 0xB405,
+		0xA006, 0x5C07, 0x1807, 0xE406, 0x9007, 0x6C06, 0x2806, 0xD407,
+		0xC00B, 0x3C0A, 0x780A, 0x840B, 0xF00A, 0x0C0B, 0x480B, 0xB40A,
+		0xA009, 0x5C08, 0x1808, 0xE409, 0x9008, 0x6C09, 0x2809, 0xD408,
+		0x000F, 0xFC0E, 0xB80E, 0x440F, 0x300E, 0xCC0F, 0x880F, 0x740E,
+		0x600D, 0x9C0C, 0xD80C, 0x240D, 0x500C, 0xAC0D, 0xE80D, 0x140C,
+		0xC015, 0x3C14, 0x7814, 0x8415, 0xF014, 0x0C15, 0x4815, 0xB414,
+		0xA017, 0x5C16, 0x1816, 0xE417, 0x9016, 0x6C17, 0x2817, 0xD416,
+		0x0011, 0xFC10, 0xB810, 0x4411, 0x3010, 0xCC11, 0x8811, 0x7410,
+		0x6013, 0x9C12, 0xD812, 0x2413, 0x5012, 0xAC13, 0xE813, 0x1412,
+		0x001E, 0xFC1F, 0xB81F, 0x441E, 0x301F, 0xCC1E, 0x881E, 0x741F,
+		0x601C, 0x9C1D, 0xD81D, 0x241C, 0x501D, 0xAC1C, 0xE81C, 0x141D,
+		0xC01A, 0x3C1B, 0x781B, 0x841A, 0xF01B, 0x0C1A, 0x481A, 0xB41B,
+		0xA018, 0x5C19, 0x1819, 0xE418, 0x9019, 0x6C18, 0x2818, 0xD419,
+		0xC029, 0x3C28, 0x7828, 0x8429, 0xF028, 0x0C29, 0x4829, 0xB428,
+		0xA02B, 0x5C2A, 0x182A, 0xE42B, 0x902A, 0x6C2B, 0x282B, 0xD42A,
+		0x002D, 0xFC2C, 0xB82C, 0x442D, 0x302C, 0xCC2D, 0x882D, 0x742C,
+		0x602F, 0x9C2E, 0xD82E, 0x242F, 0x502E, 0xAC2F, 0xE82F, 0x142E,
+		0x0022, 0xFC23, 0xB823, 0x4422, 0x3023, 0xCC22, 0x8822, 0x7423,
+		0x6020, 0x9C21, 0xD821, 0x2420, 0x5021, 0xAC20, 0xE820, 0x1421,
+		0xC026, 0x3C27, 0x7827, 0x8426, 0xF027, 0x0C26, 0x4826, 0xB427,
+		0xA024, 0x5C25, 0x1825, 0xE424, 0x9025, 0x6C24, 0x2824, 0xD425,
+		0x003C, 0xFC3D, 0xB83D, 0x443C, 0x303D, 0xCC3C, 0x883C, 0x743D,
+		0x603E, 0x9C3F, 0xD83F, 0x243E, 0x503F, 0xAC3E, 0xE83E, 0x143F,
+		0xC038, 0x3C39, 0x7839, 0x8438, 0xF039, 0x0C38, 0x4838, 0xB439,
+		0xA03A, 0x5C3B, 0x183B, 0xE43A, 0x903B, 0x6C3A, 0x283A, 0xD43B,
+		0xC037, 0x3C36, 0x7836, 0x8437, 0xF036, 0x0C37, 0x4837, 0xB436,
+		0xA035, 0x5C34, 0x1834, 0xE435, 0x9034, 0x6C35, 0x2835, 0xD434,
+		0x0033, 0xFC32, 0xB832, 0x4433, 0x3032, 0xCC33, 0x8833, 0x7432,
+		0x6031, 0x9C30, 0xD830, 0x2431, 0x5030, 0xAC31, 0xE831, 0x1430,
+	},
+};
+
+static unsigned short crc16_update(unsigned short crc, unsigned char *Buffer, int BufferSize)
+{
+	unsigned short x;
 
-		for (j = 0; j < 8; j++) {
-			if (r & 1)
-				r = (r >> 1) ^ CRCPOLY;
-			else
-				r >>= 1;
-		}
-		CRCTable[i] = r;
+	while (BufferSize >= 4) {
+		x = crc ^ (Buffer[0] | (Buffer[1] << 8));
+		crc = CRCTable[3][x & 0xFF] ^ CRCTable[2][x >> 8] ^
+		      CRCTable[1][Buffer[2]] ^ CRCTable[0][Buffer[3]];
+		Buffer += 4;
+		BufferSize -= 4;
 	}
-
-	/* now go over the entire Buffer */
-	crc = 0;
-	for (i = 0; i < BufferSize; i++)
-		crc = CRCTable[(crc ^ Buffer[i]) & 0xFF] ^ (crc >> 8);
+	while (BufferSize--)
+		crc = UPDATE_CRC(crc, *Buffer++);
 
 	return crc;
 }
 
+unsigned short CRC16Calculate(unsigned char *Buffer, int BufferSize)
+{
+	/* go over the entire Buffer */
+	return crc16_update(0, Buffer, BufferSize);
+}
+
 /*
  * Bit handling code.
+ *
+ * The bit buffer is a 32-bit (64-bit on 64-bit hosts) accumulator holding
+ * bitcount valid bits, aligned to its top end. It is refilled with as many
+ * whole bytes as fit whenever less than 16 bits are left, so that peekbits()
+ * can always look ahead up to 16 bits.
  */
-static unsigned char *CompressedBuffer;
-static int CompressedSize;
-static int CompressedOffset;
+typedef LH5BitBuf bitbuf_t;
+#define BITBUFSIZ ((int) (8 * sizeof(bitbuf_t)))
+
+static void refillbuf(LH5Context *ctx)
+{				/* Top up bitbuf with whole bytes */
+	unsigned char *p;
+	bitbuf_t w;
+	int i;
 
-static unsigned short bitbuf;
-static unsigned char subbitbuf, bitcount;
+	if (ctx->bitcount > (BITBUFSIZ - 8))
+		return;
+
+	/* Load a whole word at once if possible. Any bits of a partially loaded
+	   byte are ORed in again at the same position by the next refill. */
+	if ((ctx->CompressedOffset + (int) sizeof(bitbuf_t)) <= ctx->CompressedSize) {
+		p = ctx->CompressedBuffer + ctx->CompressedOffset;
+		w = 0;
+		for (i = 0; i < (int) sizeof(bitbuf_t); i++)
+			w = (w << 8) | p[i];
+		ctx->bitbuf |= w >> ctx->bitcount;
+		i = (BITBUFSIZ - ctx->bitcount) >> 3;
+		ctx->CompressedOffset += i;
+		ctx->bitcount += i << 3;
+		return;
+	}
 
-static void BitBufInit(unsigned char *Buffer, int BufferSize)
-{
-	CompressedBuffer = Buffer;
-	CompressedOffset = 0;
-	CompressedSize = BufferSize;
+	/* Pad with zeroes past the end of the input, but only if there's no more
+	   to come, as a stream may still be fed the actual bits later. */
+	while (ctx->bitcount <= (BITBUFSIZ - 8)) {
+		if (ctx->CompressedOffset < ctx->CompressedSize)
+			ctx->bitbuf |= (bitbuf_t) ctx->CompressedBuffer[ctx->CompressedOffset++] << (BITBUFSIZ - 8 - ctx->bitcount);
+		else if (ctx->CompressedEOF)
+			ctx->CompressedPadding++;
+		else
+			break;
+		ctx->bitcount += 8;
+	}
+}
 
-	bitbuf = 0;
-	subbitbuf = 0;
-	bitcount = 0;
+static void BitBufInit(LH5Context *ctx, unsigned char *Buffer, int BufferSize, int eof)
+{
+	ctx->CompressedBuffer = Buffer;
+	ctx->CompressedOffset = 0;
+	ctx->CompressedSize = BufferSize;
+	ctx->CompressedPadding = 0;
+	ctx->CompressedEOF = eof;
+
+	ctx->bitbuf = 0;
+	ctx->bitcount = 0;
+	refillbuf(ctx);
 }
 
-static void fillbuf(unsigned char n)
-{				/* Shift bitbuf n bits left, read n bits */
-	while (n > bitcount) {
-		n -= bitcount;
-		bitbuf = (bitbuf << bitcount) + (subbitbuf >> (8 - bitcount));
+static int BitBufConsumed(LH5Context *ctx)
+{				/* Packed bytes consumed, including 16 bits of lookahead */
+	int consumed = ((ctx->CompressedOffset + ctx->CompressedPadding) * 8) - ctx->bitcount + 16;
 
-		if (CompressedOffset < CompressedSize) {
-			subbitbuf = CompressedBuffer[CompressedOffset];
-			CompressedOffset++;
-		} else
-			subbitbuf = 0;
+	consumed = (consumed + 7) / 8;
+	return (consumed < ctx->CompressedSize) ? consumed : ctx->CompressedSize;
+}
 
-		bitcount = 8;
-	}
-	bitcount -= n;
-	bitbuf = (bitbuf << n) + (subbitbuf >> (8 - n));
-	subbitbuf <<= n;
+static void fillbuf(LH5Context *ctx, unsigned char n)
+{				/* Shift bitbuf n bits left, read n bits */
+	ctx->bitbuf <<= n;
+	ctx->bitcount -= n;
+	if (ctx->bitcount < 16)
+		refillbuf(ctx);
 }
 
-static unsigned short getbits(unsigned char n)
+static unsigned short peekbits(LH5Context *ctx, unsigned char n)
 {
-	unsigned short x;
-
-	x = bitbuf >> (16 - n);
-	fillbuf(n);
-
-	return x;
+	return (unsigned short) (ctx->bitbuf >> (BITBUFSIZ - n));
 }
 
-static unsigned short peekbits(unsigned char n)
+static unsigned short getbits(LH5Context *ctx, unsigned char n)
 {
 	unsigned short x;
 
-	x = bitbuf >> (16 - n);
+	x = peekbits(ctx, n);
+	fillbuf(ctx, n);
 
 	return x;
 }
@@ -266,42 +445,39 @@ static unsigned short peekbits(unsigned char n)
  */
 #define MIN(a,b) ((a) <= (b) ? (a) : (b))
 
-#define LZHUFF5_DICBIT		13	/* 2^13 =  8KB sliding dictionary */
-#define MAXMATCH			256	/* formerly F (not more than 255 + 1) */
-#define THRESHOLD			3	/* choose optimal value */
-#define NP					(LZHUFF5_DICBIT + 1)
-#define NT					(16 + 3)	/* USHORT + THRESHOLD */
-#define NC					(255 + MAXMATCH + 2 - THRESHOLD)
+#define MAXMATCH			LH5_MAXMATCH
+#define THRESHOLD			LH5_THRESHOLD
+#define NT					LH5_NT
+#define NC					LH5_NC
 
-#define PBIT 4			/* smallest integer such that (1 << PBIT) > * NP */
 #define TBIT 5			/* smallest integer such that (1 << TBIT) > * NT */
 #define CBIT 9			/* smallest integer such that (1 << CBIT) > * NC */
 
-/* #if NT > NP #define NPT NT #else #define NPT NP #endif  */
-#define NPT         0x80
-
-static unsigned short left[2 * NC - 1], right[2 * NC - 1];
-
-static unsigned short c_table[4096];	/* decode */
-static unsigned short pt_table[256];	/* decode */
+#define NPT         LH5_NPT
 
-static unsigned char c_len[NC];
-static unsigned char pt_len[NPT];
+/*
+ * Codes are decoded with two-level lookup tables. The first level is indexed
+ * by the next CTABLEBITS/PTTABLEBITS bits, and holds either the symbol, or
+ * SUBTABLE ORed with the index of a second level table for codes longer than
+ * that. Second level tables are indexed by the remaining bits up to 16, which
+ * is the longest code length allowed.
+ */
+#define CTABLEBITS	LH5_CTABLEBITS
+#define PTTABLEBITS	LH5_PTTABLEBITS
+#define SUBTABLE	0x8000
 
 static int
 make_table(short nchar, unsigned char bitlen[], short tablebits,
-	   unsigned short table[])
+	   unsigned short table[], unsigned short subtable[])
 {
 	unsigned short count[17];	/* count of bitlen */
 	unsigned short weight[17];	/* 0x10000ul >> bitlen */
 	unsigned short start[17];	/* first code of bitlen */
 	unsigned short total;
 	unsigned int i, l;
-	int j, k, m, n, avail;
+	int j, k, m, n, subbits, subtables;
 	unsigned short *p;
 
-	avail = nchar;
-
 	/* initialize */
 	for (i = 1; i <= 16; i++) {
 		count[i] = 0;
@@ -329,235 +505,445 @@ make_table(short nchar, unsigned char bitlen[], short tablebits,
 		return -1;
 	}
 
-	/* shift data for make table. */
-	m = 16 - tablebits;
-	for (i = 1; i <= tablebits; i++) {
-		start[i] >>= m;
-		weight[i] >>= m;
-	}
-
 	/* initialize */
-	j = start[tablebits + 1] >> m;
-	k = MIN(1 << tablebits, 4096);
-	if (j != 0)
-		for (i = j; i < k; i++)
-			table[i] = 0;
+	m = 16 - tablebits;
+	subbits = m;
+	subtables = 0;
+	for (i = 0; i < (1U << tablebits); i++)
+		table[i] = 0;
 
-	/* create table and tree */
+	/* create first and second level tables */
 	for (j = 0; j < nchar; j++) {
 		k = bitlen[j];
 		if (k == 0)
 			continue;
-		l = start[k] + weight[k];
+		i = start[k];
+		l = i + weight[k];
 		if (k <= tablebits) {
-			/* code in table */
-			l = MIN(l, 4096);
-			for (i = start[k]; i < l; i++)
+			/* code in first level table */
+			for (i >>= m, l >>= m; i < l; i++)
 				table[i] = j;
 		} else {
-			/* code not in table */
-			i = start[k];
-			if ((i >> m) > 4096) {
-				/* CVE-2006-4337 */
-				fprintf(stderr, "Error: Bad table (case c)");
-				exit(1);
-			}
+			/* code in second level table */
 			p = &table[i >> m];
-			i <<= tablebits;
-			n = k - tablebits;
-			/* make tree (n length) */
-			while (--n >= 0) {
-				if (*p == 0) {
-					right[avail] = left[avail] = 0;
-					*p = avail++;
+			if (!(*p & SUBTABLE)) {
+				if (subtables >= nchar) {
+					fprintf(stderr, "Error: make_table(): Bad table (case c)\n");
+					return -1;
 				}
-				if (i & 0x8000)
-					p = &right[*p];
-				else
-					p = &left[*p];
-				i <<= 1;
+				*p = SUBTABLE | subtables++;
+				for (n = 0; n < (1 << subbits); n++)
+					subtable[((*p & ~SUBTABLE) << subbits) + n] = 0;
 			}
-			*p = j;
+			p = &subtable[(*p & ~SUBTABLE) << subbits];
+			for (n = i & ((1 << subbits) - 1); n < (i & ((1 << subbits) - 1)) + weight[k]; n++)
+				p[n] = j;
 		}
-		start[k] = l;
+		start[k] += weight[k];
 	}
 	return 0;
 }
 
-static int read_pt_len(short nn, short nbit, short i_special)
+static unsigned short decode_pt(LH5Context *ctx)
+{
+	unsigned short j;
+
+	j = ctx->pt_table[peekbits(ctx, PTTABLEBITS)];
+	if (j & SUBTABLE)
+		j = ctx->pt_subtable[((j & ~SUBTABLE) << (16 - PTTABLEBITS)) | (peekbits(ctx, 16) & ((1 << (16 - PTTABLEBITS)) - 1))];
+	fillbuf(ctx, ctx->pt_len[j]);
+	return j;
+}
+
+static int read_pt_len(LH5Context *ctx, short nn, short nbit, short i_special)
 {
 	int i, c, n;
 
-	n = getbits(nbit);
+	n = getbits(ctx, nbit);
 	if (n == 0) {
-		c = getbits(nbit);
+		c = getbits(ctx, nbit);
+		if (c >= nn)
+			return -1;	/* the single code must be in the table */
 		for (i = 0; i < nn; i++)
-			pt_len[i] = 0;
+			ctx->pt_len[i] = 0;
 		for (i = 0; i < 256; i++)
-			pt_table[i] = c;
+			ctx->pt_table[i] = c;
 	} else {
 		i = 0;
 		while (i < MIN(n, NPT)) {
-			c = peekbits(3);
+			c = peekbits(ctx, 3);
 			if (c != 7)
-				fillbuf(3);
+				fillbuf(ctx, 3);
 			else {
 				unsigned short mask = 1 << (16 - 4);
-				while (mask & bitbuf) {
+				while (mask & peekbits(ctx, 16)) {
 					mask >>= 1;
 					c++;
 				}
-				fillbuf(c - 3);
+				fillbuf(ctx, c - 3);
 			}
 
-			pt_len[i++] = c;
+			ctx->pt_len[i++] = c;
 			if (i == i_special) {
-				c = getbits(2);
+				c = getbits(ctx, 2);
 				while (--c >= 0 && i < NPT)
-					pt_len[i++] = 0;
+					ctx->pt_len[i++] = 0;
 			}
 		}
 		while (i < nn)
-			pt_len[i++] = 0;
+			ctx->pt_len[i++] = 0;
 
-		if (make_table(nn, pt_len, 8, pt_table) == -1)
+		if (make_table(nn, ctx->pt_len, PTTABLEBITS, ctx->pt_table, ctx->pt_subtable) == -1)
 			return -1;
 	}
 	return 0;
 }
 
-static int read_c_len(void)
+static int read_c_len(LH5Context *ctx)
 {
 	short i, c, n;
 
-	n = getbits(CBIT);
+	n = getbits(ctx, CBIT);
 	if (n == 0) {
-		c = getbits(CBIT);
+		c = getbits(ctx, CBIT);
+		if (c >= NC)
+			return -1;	/* the single code must be in the table */
 		for (i = 0; i < NC; i++)
-			c_len[i] = 0;
+			ctx->c_len[i] = 0;
 		for (i = 0; i < 4096; i++)
-			c_table[i] = c;
+			ctx->c_table[i] = c;
 	} else {
 		i = 0;
 		while (i < MIN(n, NC)) {
-			c = pt_table[peekbits(8)];
-			if (c >= NT) {
-				unsigned short mask = 1 << (16 - 9);
-				do {
-					if (bitbuf & mask)
-						c = right[c];
-					else
-						c = left[c];
-					mask >>= 1;
-				} while (c >= NT && (mask || c != left[c]));	/* CVE-2006-4338 */
-			}
-			fillbuf(pt_len[c]);
+			c = decode_pt(ctx);
 			if (c <= 2) {
 				if (c == 0)
 					c = 1;
 				else if (c == 1)
-					c = getbits(4) + 3;
+					c = getbits(ctx, 4) + 3;
 				else
-					c = getbits(CBIT) + 20;
-				while (--c >= 0)
-					c_len[i++] = 0;
+					c = getbits(ctx, CBIT) + 20;
+				while (--c >= 0 && i < NC)
+					ctx->c_len[i++] = 0;
 			} else
-				c_len[i++] = c - 2;
+				ctx->c_len[i++] = c - 2;
 		}
 		while (i < NC)
-			c_len[i++] = 0;
+			ctx->c_len[i++] = 0;
 
-		if (make_table(NC, c_len, 12, c_table) == -1)
+		if (make_table(NC, ctx->c_len, CTABLEBITS, ctx->c_table, ctx->c_subtable) == -1)
 			return -1;
 	}
 	return 0;
 }
 
-static unsigned short decode_c_st1(void)
+static unsigned short decode_c_st1(LH5Context *ctx)
 {
-	unsigned short j, mask;
-
-	j = c_table[peekbits(12)];
-	if (j < NC)
-		fillbuf(c_len[j]);
-	else {
-		fillbuf(12);
-		mask = 1 << (16 - 1);
-		do {
-			if (bitbuf & mask)
-				j = right[j];
-			else
-				j = left[j];
-			mask >>= 1;
-		} while (j >= NC && (mask || j != left[j]));	/* CVE-2006-4338 */
-		fillbuf(c_len[j] - 12);
-	}
+	unsigned short j;
+
+	j = ctx->c_table[peekbits(ctx, CTABLEBITS)];
+	if (j & SUBTABLE)
+		j = ctx->c_subtable[((j & ~SUBTABLE) << (16 - CTABLEBITS)) | (peekbits(ctx, 16) & ((1 << (16 - CTABLEBITS)) - 1))];
+	fillbuf(ctx, ctx->c_len[j]);
 	return j;
 }
 
-static unsigned short decode_p_st1(void)
+static int decode_p_st1(LH5Context *ctx)
+{				/* Returns the match position, or -1 on error */
+	int j;
+
+	j = decode_pt(ctx);
+	if (j >= ctx->np)
+		return -1;
+	if (j > 1)
+		j = (1 << (j - 1)) + getbits(ctx, j - 1);
+	return j;
+}
+
+static int read_block_header(LH5Context *ctx)
+{				/* Returns the block size, or -1 on error */
+	int blocksize;
+
+	blocksize = getbits(ctx, 16);
+
+	if (read_pt_len(ctx, NT, TBIT, 3) == -1)
+		return -1;
+	if (read_c_len(ctx) == -1)
+		return -1;
+	if (read_pt_len(ctx, ctx->np, ctx->pbit, -1) == -1)
+		return -1;
+
+	return blocksize;
+}
+
+/*
+ * Copy a match of length bytes from offset bytes back. Matches which don't
+ * overlap their source are copied in one go, runs of a single byte are
+ * filled, and other overlapping matches are copied in chunks of a whole
+ * number of periods, which double in size as the copy goes on.
+ */
+#define SHORT_MATCH	16	/* longer matches go through copy_match() */
+
+static void copy_match(unsigned char *dst, int offset, int length)
 {
-	unsigned short j, mask;
-
-	j = pt_table[peekbits(8)];
-	if (j < NP)
-		fillbuf(pt_len[j]);
-	else {
-		fillbuf(8);
-		mask = 1 << (16 - 1);
-		do {
-			if (bitbuf & mask)
-				j = right[j];
-			else
-				j = left[j];
-			mask >>= 1;
-		} while (j >= NP && (mask || j != left[j]));	/* CVE-2006-4338 */
-		fillbuf(pt_len[j] - 8);
+	unsigned char *src = dst - offset;
+	int chunk;
+
+	if (offset >= length) {
+		memcpy(dst, src, length);
+	} else if (offset == 1) {
+		memset(dst, *src, length);
+	} else {
+		while (length) {
+			chunk = dst - src;
+			if (chunk > length)
+				chunk = length;
+			memcpy(dst, src, chunk);
+			dst += chunk;
+			length -= chunk;
+		}
 	}
-	if (j != 0)
-		j = (1 << (j - 1)) + getbits(j - 1);
-	return j;
 }
 
+/*
+ * The methods only differ in dictionary size, which sets the number of
+ * position codes (np) and the bits needed to count them (pbit).
+ */
+static int set_method(LH5Context *ctx, unsigned char method)
+{				/* Returns -1 if the method is not supported */
+	switch (method) {
+	case '5':
+		ctx->np = LH5_DICBIT + 1;
+		ctx->pbit = 4;
+		break;
+	case '6':
+		ctx->np = LH6_DICBIT + 1;
+		ctx->pbit = 5;
+		break;
+	case '7':
+		ctx->np = LH7_DICBIT + 1;
+		ctx->pbit = 5;
+		break;
+	default:
+		fprintf(stderr, "Error: Compression method %c is not supported.\n", method);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The CRC-16 of the output is updated as bytes are emitted, and checked
+ * against the one from the lha header once decoding is done.
+ */
 int
-LH5Decode(unsigned char *PackedBuffer, int PackedBufferSize,
-	  unsigned char *OutputBuffer, int OutputBufferSize)
+LH5Decode(LH5Context *ctx, unsigned char *PackedBuffer, int PackedBufferSize,
+	  unsigned char *OutputBuffer, int OutputBufferSize,
+	  unsigned short crc, unsigned char method)
 {
-	unsigned short blocksize = 0;
-	unsigned int i, c;
-	int n = 0;
+	unsigned short blocksize = 0, output_crc = 0;
+	unsigned int c;
+	int n = 0, header;
 
-	BitBufInit(PackedBuffer, PackedBufferSize);
-	fillbuf(2 * 8);
+	if (set_method(ctx, method) == -1)
+		return -1;
+	BitBufInit(ctx, PackedBuffer, PackedBufferSize, 1);
 
 	while (n < OutputBufferSize) {
 		if (blocksize == 0) {
-			blocksize = getbits(16);
-
-			if (read_pt_len(NT, TBIT, 3) == -1)
-				return -1;
-			if (read_c_len() == -1)
-				return -1;
-			if (read_pt_len(NP, PBIT, -1) == -1)
+			header = read_block_header(ctx);
+			if (header == -1)
 				return -1;
+			blocksize = header;
 		}
 		blocksize--;
-		c = decode_c_st1();
+		c = decode_c_st1(ctx);
 
-		if (c < 256)
+		if (c < 256) {
 			OutputBuffer[n++] = c;
-		else {
+			output_crc = UPDATE_CRC(output_crc, c);
+		} else {
 			int length = c - 256 + THRESHOLD;
-			int offset = 1 + decode_p_st1();
+			int offset = 1 + decode_p_st1(ctx);
 
-			if (offset > n)
+			if ((offset <= 0) || (offset > n))
 				return -1;
 
-			for (i = 0; (i < length) && (n < OutputBufferSize); i++) {
-				OutputBuffer[n] = OutputBuffer[n - offset];
-				n++;
+			if (length > (OutputBufferSize - n))
+				length = OutputBufferSize - n;
+
+			/* short matches are quicker to copy byte by byte */
+			if (length <= SHORT_MATCH) {
+				while (length--) {
+					c = OutputBuffer[n] = OutputBuffer[n - offset];
+					output_crc = UPDATE_CRC(output_crc, c);
+					n++;
+				}
+			} else {
+				copy_match(OutputBuffer + n, offset, length);
+				output_crc = crc16_update(output_crc, OutputBuffer + n, length);
+				n += length;
 			}
 		}
 	}
-	return CompressedOffset;
+
+	if (output_crc != crc) {
+		fprintf(stderr, "Error: CRC mismatch.\n");
+		return -1;
+	}
+	return BitBufConsumed(ctx);
+}
+
+/*
+ * Streaming decoder.
+ *
+ * Packed data is fed in chunks of any size through LH5StreamFeed(), and
+ * decoded data is drained in chunks of any size through LH5StreamDrain().
+ * Only the dictionary is kept as a sliding window, so members of any size
+ * can be decoded with a fixed amount of memory. The window is sized for the
+ * largest dictionary (-lh7-), so it fits every method.
+ *
+ * The decoder only starts on a block header once STREAM_BLOCK_MARGIN bytes of
+ * input are buffered, and on a code once STREAM_CODE_MARGIN bytes are, which
+ * covers their worst case sizes. This way, decoding never has to be suspended
+ * halfway through.
+ */
+#define STREAM_WINDOW_SIZE	(1 << LH5_MAX_DICBIT)
+#define STREAM_BUFFER_SIZE	LH5_STREAM_BUFFER_SIZE
+#define STREAM_BLOCK_MARGIN	2048	/* 16 + ~330 + ~12750 + ~300 bits */
+#define STREAM_CODE_MARGIN	8	/* 16 + 16 + 15 bits */
+
+int LH5StreamInit(LH5Context *ctx, unsigned int original_size, unsigned short crc,
+		  unsigned char method)
+{
+	if (set_method(ctx, method) == -1)
+		return -1;
+	BitBufInit(ctx, ctx->StreamBuffer, 0, 0);
+
+	ctx->StreamOutput = 0;
+	ctx->StreamOriginalSize = original_size;
+	ctx->StreamBlockSize = 0;
+	ctx->StreamCRC = 0;
+	ctx->StreamExpectedCRC = crc;
+	ctx->StreamMatchLength = 0;
+	ctx->StreamMatchOffset = 0;
+	return 0;
+}
+
+int LH5StreamFeed(LH5Context *ctx, unsigned char *Buffer, int BufferSize)
+{
+	int space;
+
+	/* An empty buffer marks the end of the input */
+	if (BufferSize <= 0) {
+		ctx->CompressedEOF = 1;
+		return 0;
+	}
+
+	/* Move the unread input to the start of the buffer */
+	if (ctx->CompressedOffset) {
+		memmove(ctx->StreamBuffer, ctx->StreamBuffer + ctx->CompressedOffset,
+			ctx->CompressedSize - ctx->CompressedOffset);
+		ctx->CompressedSize -= ctx->CompressedOffset;
+		ctx->CompressedOffset = 0;
+	}
+
+	/* Take as much new input as fits */
+	space = STREAM_BUFFER_SIZE - ctx->CompressedSize;
+	if (BufferSize > space)
+		BufferSize = space;
+	memcpy(ctx->StreamBuffer + ctx->CompressedSize, Buffer, BufferSize);
+	ctx->CompressedSize += BufferSize;
+
+	return BufferSize;
+}
+
+/*
+ * Copy as much of the current match as fits. If it is long and its source
+ * is within what this drain has already output, it is copied there directly
+ * and then saved to the window; otherwise, it is copied out of the window
+ * byte by byte.
+ */
+static int stream_copy_match(LH5Context *ctx, unsigned char *OutputBuffer, int n, int OutputBufferSize)
+{
+	unsigned char *dst = OutputBuffer + n;
+	unsigned int pos = ctx->StreamOutput & (STREAM_WINDOW_SIZE - 1);
+	int i, length = ctx->StreamMatchLength, wrap;
+
+	if (length > (OutputBufferSize - n))
+		length = OutputBufferSize - n;
+	if (length > (ctx->StreamOriginalSize - ctx->StreamOutput))
+		length = ctx->StreamOriginalSize - ctx->StreamOutput;
+
+	if ((length > SHORT_MATCH) && (ctx->StreamMatchOffset <= n)) {
+		copy_match(dst, ctx->StreamMatchOffset, length);
+		ctx->StreamCRC = crc16_update(ctx->StreamCRC, dst, length);
+		wrap = STREAM_WINDOW_SIZE - pos;
+		if (wrap > length)
+			wrap = length;
+		memcpy(ctx->StreamWindow + pos, dst, wrap);
+		memcpy(ctx->StreamWindow, dst + wrap, length - wrap);
+	} else {
+		for (i = 0; i < length; i++) {
+			dst[i] = ctx->StreamWindow[(pos + i - ctx->StreamMatchOffset) & (STREAM_WINDOW_SIZE - 1)];
+			ctx->StreamWindow[(pos + i) & (STREAM_WINDOW_SIZE - 1)] = dst[i];
+			ctx->StreamCRC = UPDATE_CRC(ctx->StreamCRC, dst[i]);
+		}
+	}
+
+	ctx->StreamOutput += length;
+	ctx->StreamMatchLength -= length;
+	return length;
+}
+
+int LH5StreamDrain(LH5Context *ctx, unsigned char *OutputBuffer, int OutputBufferSize)
+{
+	int n = 0, header, available;
+	unsigned int c;
+
+	refillbuf(ctx);
+
+	while ((n < OutputBufferSize) && (ctx->StreamOutput < ctx->StreamOriginalSize)) {
+		/* Finish copying the current match */
+		if (ctx->StreamMatchLength) {
+			n += stream_copy_match(ctx, OutputBuffer, n, OutputBufferSize);
+			continue;
+		}
+
+		/* Stop if the next step could run out of input */
+		if (!ctx->CompressedEOF) {
+			available = ctx->CompressedSize - ctx->CompressedOffset + (ctx->bitcount >> 3);
+			if (available < (ctx->StreamBlockSize ? STREAM_CODE_MARGIN : STREAM_BLOCK_MARGIN))
+				break;
+		}
+
+		if (ctx->StreamBlockSize == 0) {
+			header = read_block_header(ctx);
+			if (header == -1)
+				return -1;
+			ctx->StreamBlockSize = header;
+		}
+		ctx->StreamBlockSize--;
+		c = decode_c_st1(ctx);
+
+		if (c >= 256) {
+			ctx->StreamMatchLength = c - 256 + THRESHOLD;
+			ctx->StreamMatchOffset = 1 + decode_p_st1(ctx);
+
+			if ((ctx->StreamMatchOffset <= 0) || (ctx->StreamMatchOffset > ctx->StreamOutput))
+				return -1;
+			continue;
+		}
+
+		ctx->StreamWindow[ctx->StreamOutput & (STREAM_WINDOW_SIZE - 1)] = c;
+		ctx->StreamCRC = UPDATE_CRC(ctx->StreamCRC, c);
+		ctx->StreamOutput++;
+		OutputBuffer[n++] = c;
+	}
+
+	/* Check the CRC once all output was produced */
+	if (n && (ctx->StreamOutput == ctx->StreamOriginalSize) && (ctx->StreamCRC != ctx->StreamExpectedCRC)) {
+		fprintf(stderr, "Error: CRC mismatch.\n");
+		return -1;
+	}
+	return n;
 }
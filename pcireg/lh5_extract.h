@@ -19,6 +19,59 @@
 #ifndef LH5_EXTRACT_H
 #define LH5_EXTRACT_H
 
+#define LH5_DICBIT		13	/* 2^13 =  8KB sliding dictionary */
+#define LH6_DICBIT		15	/* 2^15 = 32KB sliding dictionary */
+#define LH7_DICBIT		16	/* 2^16 = 64KB sliding dictionary */
+#define LH5_MAX_DICBIT		LH7_DICBIT
+#define LH5_MAXMATCH		256	/* formerly F (not more than 255 + 1) */
+#define LH5_THRESHOLD		3	/* choose optimal value */
+#define LH5_NT			(16 + 3)	/* USHORT + THRESHOLD */
+#define LH5_NC			(255 + LH5_MAXMATCH + 2 - LH5_THRESHOLD)
+/* #if NT > NP #define NPT NT #else #define NPT NP #endif  */
+#define LH5_NPT			0x80	/* also covers -lh6-/-lh7- */
+#define LH5_CTABLEBITS		12
+#define LH5_PTTABLEBITS		8
+#define LH5_STREAM_BUFFER_SIZE	4096
+
+#if defined(__LP64__) || defined(_WIN64)
+typedef unsigned long long LH5BitBuf;
+#else
+typedef unsigned long LH5BitBuf;
+#endif
+
+/*
+ * All decoder state, so that several members can be decoded at once.
+ * This is around 104KB, which is best allocated rather than put on the
+ * stack, especially on 16-bit targets.
+ */
+typedef struct {
+	short np;		/* position codes for the method's dictionary */
+	short pbit;		/* bits needed to count them */
+
+	unsigned char *CompressedBuffer;
+	int CompressedSize;
+	int CompressedOffset;
+	int CompressedPadding;
+	int CompressedEOF;	/* no more input will follow CompressedBuffer */
+
+	LH5BitBuf bitbuf;
+	int bitcount;
+
+	unsigned short c_table[1 << LH5_CTABLEBITS];	/* decode */
+	unsigned short pt_table[1 << LH5_PTTABLEBITS];	/* decode */
+	unsigned short c_subtable[LH5_NC << (16 - LH5_CTABLEBITS)];	/* decode */
+	unsigned short pt_subtable[LH5_NT << (16 - LH5_PTTABLEBITS)];	/* decode */
+
+	unsigned char c_len[LH5_NC];
+	unsigned char pt_len[LH5_NPT];
+
+	unsigned char StreamBuffer[LH5_STREAM_BUFFER_SIZE];
+	unsigned char StreamWindow[1 << LH5_MAX_DICBIT];
+	unsigned int StreamOutput, StreamOriginalSize;
+	unsigned short StreamBlockSize, StreamCRC, StreamExpectedCRC;
+	int StreamMatchLength, StreamMatchOffset;
+} LH5Context;
+
 unsigned int LH5HeaderParse(unsigned char *Buffer, int BufferSize,
 			    unsigned int *original_size,
 			    unsigned int *packed_size,
@@ -27,7 +80,16 @@ unsigned int LH5HeaderParse(unsigned char *Buffer, int BufferSize,
 
 unsigned short CRC16Calculate(unsigned char *Buffer, int BufferSize);
 
-int LH5Decode(unsigned char *PackedBuffer, int PackedBufferSize,
-	      unsigned char *OutputBuffer, int OutputBufferSize);
+int LH5Decode(LH5Context *ctx,
+	      unsigned char *PackedBuffer, int PackedBufferSize,
+	      unsigned char *OutputBuffer, int OutputBufferSize,
+	      unsigned short crc, unsigned char method);
+
+int LH5StreamInit(LH5Context *ctx, unsigned int original_size, unsigned short crc,
+		  unsigned char method);
+
+int LH5StreamFeed(LH5Context *ctx, unsigned char *Buffer, int BufferSize);
+
+int LH5StreamDrain(LH5Context *ctx, unsigned char *OutputBuffer, int OutputBufferSize);
 
 #endif				/* LH5_EXTRACT_H */
@@ -0,0 +1,548 @@
+/*
+ * 86Box	A hypervisor and IBM PC system emulator that specializes in
+ *		running old operating systems and software designed for IBM
+ *		PC systems and compatibles from 1981 through fairly recent
+ *		system designs based on the PCI bus.
+ *
+ *		This file is part of the 86Box Probing Tools distribution.
+ *
+ *		Host tool for benchmarking and fuzzing the LHA decoder.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lh5_compress.h"
+#include "lh5_extract.h"
+#if defined(__i386__) || defined(__x86_64__)
+#    include <x86intrin.h>
+#    define HAVE_RDTSC
+#endif
+
+#define MAX_MEMBERS     256
+#define GENERATED_SIZE  (256 << 10) /* size of each generated member */
+#define FUZZ_MAX_OUTPUT (16 << 20)  /* larger members are skipped when fuzzing */
+
+typedef struct {
+    char           name[32];
+    unsigned char *data; /* header followed by packed data */
+    int            header_size, packed_size;
+    unsigned int   original_size;
+    unsigned short crc;
+    unsigned char  method;
+} member_t;
+
+static member_t     members[MAX_MEMBERS];
+static int          member_count = 0;
+static LH5Context   ctx;
+static unsigned int rng          = 1;
+
+static unsigned int
+rand32(void)
+{
+    /* xorshift32, so that generated members and fuzzing runs are the same on every host. */
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static unsigned long long
+cycles(void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int
+add_member(const char *name, unsigned char *header, int header_size, unsigned char *packed, int packed_size,
+           unsigned int original_size, unsigned short crc, unsigned char method)
+{
+    member_t *m;
+
+    if (member_count >= MAX_MEMBERS) {
+        printf("Too many members, ignoring %s\n", name);
+        return 1;
+    }
+    m       = &members[member_count];
+    m->data = malloc(header_size + packed_size);
+    if (!m->data)
+        return 1;
+    memcpy(m->data, header, header_size);
+    memcpy(m->data + header_size, packed, packed_size);
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    m->header_size   = header_size;
+    m->packed_size   = packed_size;
+    m->original_size = original_size;
+    m->crc           = crc;
+    m->method        = method;
+    member_count++;
+    return 0;
+}
+
+static int
+load_archive(const char *path)
+{
+    FILE          *f;
+    unsigned char *buf;
+    char          *name;
+    long           size, pos = 0;
+    unsigned int   header_size, original_size, packed_size;
+    unsigned short crc;
+    unsigned char  method;
+
+    /* Read the whole archive. */
+    f = fopen(path, "rb");
+    if (!f) {
+        printf("Could not open %s\n", path);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(size + 1);
+    if (!buf || (size && !fread(buf, size, 1, f))) {
+        printf("Could not read %s\n", path);
+        fclose(f);
+        free(buf);
+        return 1;
+    }
+    fclose(f);
+
+    /* Add every compressed member. Stored members have nothing to decode. */
+    while ((pos < size) && buf[pos]) {
+        name        = NULL;
+        header_size = LH5HeaderParse(buf + pos, size - pos, &original_size, &packed_size, &name, &crc, &method);
+        if (!header_size || ((size - pos - header_size) < packed_size)) {
+            printf("Bad member at offset %ld of %s\n", pos, path);
+            free(name);
+            free(buf);
+            return 1;
+        }
+        if (method != '0')
+            add_member(name ? name : "?", buf + pos, header_size, buf + pos + header_size, packed_size, original_size, crc, method);
+        free(name);
+        pos += header_size + packed_size;
+    }
+
+    free(buf);
+    return 0;
+}
+
+static void
+generate_members(void)
+{
+    static const char *const words[] = { "Intel", "Corporation", "Device", "Controller", "Bridge", "PCI", "Express",
+                                         "Root", "Port", "USB", "Audio", "SMBus", "Host", "(rev", "0x", "\n\t" };
+    static const char *const kinds[] = { "zero", "period", "text", "random" };
+    unsigned char           *in, *out, header[64];
+    char                     name[32];
+    const char              *word;
+    int                      kind, i, j, count, packed_size, header_size;
+    unsigned char            method;
+    unsigned short           crc;
+
+    in  = malloc(GENERATED_SIZE);
+    out = malloc(GENERATED_SIZE * 2);
+    if (!in || !out) {
+        free(in);
+        free(out);
+        return;
+    }
+
+    for (kind = 0; kind < 4; kind++) {
+        /* Fill the input with data that exercises a different part of the decoder. */
+        rng = 1;
+        for (i = 0; i < GENERATED_SIZE;) {
+            switch (kind) {
+                case 0: /* single symbol trees and the longest matches */
+                    in[i++] = 0;
+                    break;
+
+                case 1: /* overlapping matches with short offsets, between literals */
+                    in[i++] = rand32();
+                    for (count = rand32() & 255, j = 1 + (rand32() & 7); count-- && (i < GENERATED_SIZE) && (i >= j); i++)
+                        in[i] = in[i - j];
+                    break;
+
+                case 2: /* text, like the PCI ID databases */
+                    for (word = words[rand32() & 15]; *word && (i < GENERATED_SIZE); word++)
+                        in[i++] = *word;
+                    if (i < GENERATED_SIZE)
+                        in[i++] = ' ';
+                    break;
+
+                default: /* literals only */
+                    in[i++] = rand32();
+                    break;
+            }
+        }
+        crc = CRC16Calculate(in, GENERATED_SIZE);
+
+        for (method = '5'; method <= '7'; method++) {
+            snprintf(name, sizeof(name), "gen-%s.lh%c", kinds[kind], method);
+            packed_size = LH5Encode(in, GENERATED_SIZE, out, GENERATED_SIZE * 2, 0, method);
+            header_size = LH5HeaderWrite(header, sizeof(header), name, GENERATED_SIZE, packed_size, crc, method, 0x00210000);
+            if ((packed_size < 0) || !header_size) {
+                printf("Could not generate %s\n", name);
+                continue;
+            }
+            add_member(name, header, header_size, out, packed_size, GENERATED_SIZE, crc, method);
+        }
+    }
+
+    free(in);
+    free(out);
+}
+
+static void
+put_bits(unsigned char *buf, int *pos, int n, unsigned int val)
+{
+    /* Append bits most significant first, as the decoder reads them. */
+    while (n--) {
+        if ((val >> n) & 1)
+            buf[*pos >> 3] |= 0x80 >> (*pos & 7);
+        (*pos)++;
+    }
+}
+
+static void
+add_seeds(void)
+{
+    static const char *const sections[] = { "t", "c", "p" };
+    unsigned char            packed[16], header[64];
+    char                     name[32];
+    int                      section, pos, pbit, header_size;
+    unsigned char            method;
+
+    /* Blocks whose T, C or P tree is a single symbol (a zero code count followed
+       by the symbol), out of range in one section, which the decoder must reject
+       before using it. Random corruption is unlikely to produce these. */
+    for (method = '5'; method <= '7'; method++) {
+        pbit = (method == '5') ? 4 : 5;
+        for (section = 0; section < 3; section++) {
+            memset(packed, 0, sizeof(packed));
+            pos = 0;
+            put_bits(packed, &pos, 16, 16);                                    /* block size */
+            put_bits(packed, &pos, 5, 0);                                      /* T: single symbol */
+            put_bits(packed, &pos, 5, (section == 0) ? 31 : 0);
+            put_bits(packed, &pos, 9, 0);                                      /* C: single symbol */
+            put_bits(packed, &pos, 9, (section == 1) ? 511 : 256);
+            put_bits(packed, &pos, pbit, 0);                                   /* P: single symbol */
+            put_bits(packed, &pos, pbit, (section == 2) ? ((1 << pbit) - 1) : 0);
+
+            snprintf(name, sizeof(name), "seed-%s.lh%c", sections[section], method);
+            header_size = LH5HeaderWrite(header, sizeof(header), name, 16, sizeof(packed), 0, method, 0x00210000);
+            if (header_size)
+                add_member(name, header, header_size, packed, sizeof(packed), 16, 0, method);
+        }
+    }
+}
+
+/*
+ * Decode a buffer as an archive, with both the whole-member decoder and the
+ * streaming decoder, which must agree. Corrupt input may be rejected, but
+ * must never crash or read out of bounds. This is the fuzzing entry point.
+ */
+static void
+decode_archive(const unsigned char *data, size_t size)
+{
+    unsigned char *buf, *out, *stream_out;
+    char          *name;
+    size_t         pos = 0;
+    unsigned int   header_size, original_size, packed_size, in, produced;
+    unsigned short crc;
+    unsigned char  method;
+    unsigned int   chunk;
+    int            ret, stream_ret, n, eof;
+
+    /* Copy the data into an exactly sized buffer, so that overreads are caught. */
+    buf = malloc(size ? size : 1);
+    if (!buf)
+        return;
+    memcpy(buf, data, size);
+
+    while ((pos < size) && buf[pos]) {
+        name        = NULL;
+        header_size = LH5HeaderParse(buf + pos, size - pos, &original_size, &packed_size, &name, &crc, &method);
+        free(name);
+        if (!header_size || (header_size > (size - pos)) || ((size - pos - header_size) < packed_size))
+            break;
+        pos += header_size;
+        if ((method == '0') || (original_size > FUZZ_MAX_OUTPUT)) {
+            pos += packed_size;
+            continue;
+        }
+
+        out        = malloc(original_size ? original_size : 1);
+        stream_out = malloc(original_size ? original_size : 1);
+        if (!out || !stream_out) {
+            free(out);
+            free(stream_out);
+            break;
+        }
+
+        /* Whole-member decoder. */
+        ret = LH5Decode(&ctx, buf + pos, packed_size, out, original_size, crc, method);
+
+        /* Streaming decoder, fed and drained in uneven chunks. */
+        stream_ret = LH5StreamInit(&ctx, original_size, crc, method);
+        in = produced = eof = 0;
+        chunk             = 1;
+        while (!stream_ret && (produced < original_size)) {
+            if (in < packed_size)
+                in += LH5StreamFeed(&ctx, buf + pos + in, ((packed_size - in) < chunk) ? (packed_size - in) : chunk);
+            else if (!eof)
+                eof = !LH5StreamFeed(&ctx, NULL, 0);
+            else if (eof++ > 2)
+                stream_ret = -1; /* packed data ended before the original data */
+            n = LH5StreamDrain(&ctx, stream_out + produced, ((original_size - produced) < chunk) ? (original_size - produced) : chunk);
+            if (n < 0)
+                stream_ret = -1;
+            else
+                produced += n;
+            chunk = (chunk * 7 + 3) % 5000 + 1;
+        }
+
+        /* Members which pass the CRC check must decode identically. */
+        if ((ret >= 0) && !stream_ret && memcmp(out, stream_out, original_size)) {
+            printf("Decoders disagree on a member at offset %lu\n", (unsigned long) pos);
+            abort();
+        }
+
+        free(out);
+        free(stream_out);
+        pos += packed_size;
+    }
+
+    free(buf);
+}
+
+#ifdef LH5BENCH_LIBFUZZER
+int
+LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+    decode_archive(data, size);
+    return 0;
+}
+#else
+static int
+benchmark(int reps)
+{
+    member_t          *m;
+    unsigned char     *out;
+    int                i, r, ret = 0;
+    double             t, best, total_time = 0;
+    unsigned long long c, best_cycles, total_cycles = 0;
+    unsigned long      total_size = 0;
+
+    printf("%-20s %6s %9s %9s %9s %9s\n", "Member", "Method", "Packed", "Original", "MB/s", "Cycles/B");
+    for (i = 0; i < member_count; i++) {
+        m   = &members[i];
+        out = malloc(m->original_size ? m->original_size : 1);
+        if (!out)
+            return 1;
+
+        /* Keep the fastest run, which is the least disturbed by the rest of the system. */
+        best        = 1e9;
+        best_cycles = ~0ULL;
+        for (r = 0; r < reps; r++) {
+            t = now();
+            c = cycles();
+            if (LH5Decode(&ctx, m->data + m->header_size, m->packed_size, out, m->original_size, m->crc, m->method) < 0) {
+                printf("%-20s failed to decode\n", m->name);
+                ret = 1;
+                break;
+            }
+            c = cycles() - c;
+            t = now() - t;
+            if (t < best)
+                best = t;
+            if (c < best_cycles)
+                best_cycles = c;
+        }
+        free(out);
+        if (r < reps)
+            continue;
+
+        printf("%-20s  -lh%c- %9d %9u %9.1f", m->name, m->method, m->packed_size, m->original_size, m->original_size / best / 1e6);
+#ifdef HAVE_RDTSC
+        printf(" %9.2f\n", m->original_size ? ((double) best_cycles / m->original_size) : 0);
+#else
+        printf(" %9s\n", "-");
+#endif
+        total_time += best;
+        total_cycles += best_cycles;
+        total_size += m->original_size;
+    }
+
+    if (total_time > 0) {
+        printf("%-20s %6s %9s %9lu %9.1f", "Total", "", "", total_size, total_size / total_time / 1e6);
+#ifdef HAVE_RDTSC
+        printf(" %9.2f\n", (double) total_cycles / total_size);
+#else
+        printf(" %9s\n", "-");
+#endif
+    }
+    return ret;
+}
+
+static void
+fuzz(unsigned long iterations)
+{
+    member_t      *m;
+    unsigned char *buf;
+    unsigned long  it;
+    int            size, i, count;
+
+    /* Decode every member uncorrupted first, which covers the seeds as they are. */
+    for (i = 0; i < member_count; i++)
+        decode_archive(members[i].data, members[i].header_size + members[i].packed_size);
+
+    for (it = 0; it < iterations; it++) {
+        /* Copy a random member, then corrupt it in one of several ways. */
+        m    = &members[rand32() % member_count];
+        size = m->header_size + m->packed_size;
+        buf  = malloc(size);
+        if (!buf)
+            return;
+        memcpy(buf, m->data, size);
+
+        switch (rand32() & 3) {
+            case 0: /* flip bits */
+                for (count = 1 + (rand32() & 7), i = 0; i < count; i++)
+                    buf[rand32() % size] ^= 1 << (rand32() & 7);
+                break;
+
+            case 1: /* overwrite bytes in the packed data, where the trees are described */
+                for (count = 1 + (rand32() & 3), i = 0; i < count; i++)
+                    buf[m->header_size + (rand32() % (m->packed_size ? m->packed_size : 1))] = rand32();
+                break;
+
+            case 2: /* overwrite header bytes */
+                buf[rand32() % m->header_size] = rand32();
+                break;
+
+            default: /* truncate */
+                size = rand32() % size;
+                break;
+        }
+
+        decode_archive(buf, size);
+        free(buf);
+
+        if (!((it + 1) % 1000))
+            fprintf(stderr, "%lu iterations\n", it + 1);
+    }
+}
+
+static int
+parse_count(const char *s, unsigned long *val)
+{
+    char *end;
+    long  n;
+
+    /* Accept positive decimal numbers only. */
+    n = strtol(s, &end, 10);
+    if ((end == s) || *end || (n < 1))
+        return 1;
+    *val = n;
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    FILE          *f;
+    unsigned char *buf;
+    long           size;
+    int            i, reps = 20, generate = 1, usage = 0, ret = 0;
+    unsigned long  iterations = 0, val;
+
+    /* Parse flags. */
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+        if (!strcmp(argv[i], "-n") && ((i + 1) < argc)) {
+            if (parse_count(argv[++i], &val)) {
+                usage = 1;
+                break;
+            }
+            reps = val;
+        } else if (!strcmp(argv[i], "-f") && ((i + 1) < argc)) {
+            if (parse_count(argv[++i], &iterations)) {
+                usage = 1;
+                break;
+            }
+        } else if (!strcmp(argv[i], "-g")) {
+            generate = 0;
+        } else if (!strcmp(argv[i], "-x") && ((i + 1) < argc)) {
+            /* Decode a single file, as fuzzers such as AFL do through @@. */
+            f = fopen(argv[++i], "rb");
+            if (!f)
+                return 1;
+            fseek(f, 0, SEEK_END);
+            size = ftell(f);
+            fseek(f, 0, SEEK_SET);
+            buf = malloc(size + 1);
+            if (buf && (!size || fread(buf, size, 1, f)))
+                decode_archive(buf, size);
+            free(buf);
+            fclose(f);
+            return 0;
+        } else {
+            /* -h, unknown flags and flags missing their value. */
+            usage = 1;
+            break;
+        }
+    }
+
+    /* Print usage if requested, or if there is nothing to decode. */
+    if (usage || (!generate && (i == argc))) {
+        printf("%s [-n reps] [-g] [-f iterations] [archive...]\n", argv[0]);
+        printf("%s -x file\n", argv[0]);
+        printf("- Benchmarks the LHA decoder on every compressed member of the archives, such\n");
+        printf("  as PCIIDS.LHA or BIOS images, plus generated members in every method.\n");
+        printf("  Specify -n to set the runs per member (default 20), of which the fastest is kept.\n");
+        printf("  Specify -g to leave out the generated members.\n");
+        printf("  Specify -f to fuzz the decoder with corrupted copies of the members and of\n");
+        printf("  hand-made members with out-of-range single-symbol trees instead,\n");
+        printf("  preferably in a build with SANITIZE=y. Decoder errors are printed to stderr.\n");
+        printf("- Specify -x to decode a single file, for use with AFL.\n");
+        return 1;
+    }
+
+    /* Build the corpus. */
+    for (; i < argc; i++) {
+        if (load_archive(argv[i]))
+            ret = 1;
+    }
+    if (generate)
+        generate_members();
+    if (!member_count) {
+        printf("No compressed members found\n");
+        return 1;
+    }
+
+    if (iterations) {
+        add_seeds();
+        fuzz(iterations);
+        printf("Fuzzed %lu corrupted members without a crash\n", iterations);
+    } else if (benchmark(reps)) {
+        ret = 1;
+    }
+
+    return ret;
+}
+#endif
@@ -0,0 +1,135 @@
+/*
+ * 86Box	A hypervisor and IBM PC system emulator that specializes in
+ *		running old operating systems and software designed for IBM
+ *		PC systems and compatibles from 1981 through fairly recent
+ *		system designs based on the PCI bus.
+ *
+ *		This file is part of the 86Box Probing Tools distribution.
+ *
+ *		Host tool for compressing the PCI ID database into an LHA
+ *		archive, in place of lha a1o5.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "lh5_compress.h"
+#include "lh5_extract.h"
+
+static unsigned long
+dos_time(time_t t)
+{
+    struct tm *tm = localtime(&t);
+
+    /* Dates before 1980 can't be represented. */
+    if (!tm || (tm->tm_year < 80))
+        return 0x00210000; /* 1980-01-01 00:00 */
+    return ((unsigned long) (((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday) << 16) | (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec >> 1);
+}
+
+static int
+add_file(FILE *archive, const char *path, int optimal, unsigned char lh_method)
+{
+    FILE          *f;
+    struct stat    st;
+    unsigned char *in, *out, header[256];
+    const char    *name;
+    int            size, packed_size, header_size;
+    unsigned char  method = lh_method;
+
+    /* Read the whole file. */
+    f = fopen(path, "rb");
+    if (!f || fstat(fileno(f), &st)) {
+        printf("Could not open %s\n", path);
+        if (f)
+            fclose(f);
+        return 1;
+    }
+    size = st.st_size;
+    in   = malloc(size + 1);
+    out  = malloc(size + 1);
+    if (!in || !out || (size && !fread(in, size, 1, f))) {
+        printf("Could not read %s\n", path);
+        fclose(f);
+        free(in);
+        free(out);
+        return 1;
+    }
+    fclose(f);
+
+    /* Compress, or store the file if it doesn't get any smaller. */
+    packed_size = LH5Encode(in, size, out, size, optimal, method);
+    if ((packed_size < 0) || (packed_size >= size)) {
+        memcpy(out, in, size);
+        packed_size = size;
+        method      = '0';
+    }
+
+    /* Write header and data, with the path stripped from the file name. */
+    name = strrchr(path, '/');
+    if (!name)
+        name = strrchr(path, '\\');
+    name        = name ? (name + 1) : path;
+    header_size = LH5HeaderWrite(header, sizeof(header), (char *) name, size, packed_size, CRC16Calculate(in, size), method, dos_time(st.st_mtime));
+    if (!header_size || !fwrite(header, header_size, 1, archive) || (packed_size && !fwrite(out, packed_size, 1, archive))) {
+        printf("Could not write %s to archive\n", name);
+        free(in);
+        free(out);
+        return 1;
+    }
+    printf("%s: %d -> %d (%d%%)\n", name, size, packed_size, size ? ((packed_size * 100) / size) : 100);
+
+    free(in);
+    free(out);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    FILE         *archive;
+    int           i, optimal = 1, ret = 0;
+    unsigned char method = '5';
+
+    /* Parse flags. */
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+        if (!strcmp(argv[i], "-l"))
+            optimal = 0;
+        else if ((argv[i][1] == 'm') && (argv[i][2] >= '5') && (argv[i][2] <= '7') && !argv[i][3])
+            method = argv[i][2];
+        else
+            break;
+    }
+
+    /* Print usage if there are too few parameters. */
+    if ((argc - i) < 2) {
+        printf("%s [-l] [-m5|-m6|-m7] archive file [file...]\n", argv[0]);
+        printf("- Compresses the files into a new LHA archive with level 1 headers.\n");
+        printf("  Specify -l to use faster lazy parsing instead of optimal parsing.\n");
+        printf("  Specify -m6 or -m7 to use -lh6- (32 KB) or -lh7- (64 KB) dictionaries\n");
+        printf("  instead of -lh5- (8 KB).\n");
+        return 1;
+    }
+
+    /* Create archive. */
+    archive = fopen(argv[i], "wb");
+    if (!archive) {
+        printf("Could not create %s\n", argv[i]);
+        return 1;
+    }
+
+    /* Add files, then the end of archive marker. */
+    for (i++; i < argc; i++) {
+        if (add_file(archive, argv[i], optimal, method)) {
+            ret = 1;
+            break;
+        }
+    }
+    if (fputc(0, archive) == EOF)
+        ret = 1;
+    fclose(archive);
+
+    return ret;
+}
@@ -15,7 +15,206 @@
 #
 #                Copyright 2021-2024 RichardG.
 #
-import pciutil, struct, sys
+import bisect, collections, os, pciutil, re, struct, subprocess, sys
+
+# Token byte ranges used in the string database. Must match pcireg.c.
+TOKEN_1BYTE_FIRST = 0x08
+TOKEN_1BYTE_COUNT = 0x20 - TOKEN_1BYTE_FIRST
+TOKEN_2BYTE_COUNT = (TOKEN_1BYTE_FIRST - 1) * 255
+
+# Vendors with up to this many device entries are left out of the device hash,
+# as pcireg scans their entries directly. Must match pcireg.c.
+HASH_MIN_DEVICES = 16
+
+def hash_key(key, seed):
+	# 32-bit FNV-1a over the key's 4 bytes, with the seed mixed into the basis.
+	# This must match pciids_hash in pcireg.c.
+	h = 0x811c9dc5 ^ seed
+	for i in range(4):
+		h = ((h ^ ((key >> (i * 8)) & 0xff)) * 0x01000193) & 0xffffffff
+	return h
+
+def place_hash_buckets(entries, bucket_count, slot_count):
+	# Distribute the keys over buckets.
+	buckets = [[] for _ in range(bucket_count)]
+	for key, index in entries:
+		buckets[hash_key(key, 0) % bucket_count].append((hash_key(key, 1) % slot_count, (hash_key(key, 2) % (slot_count - 1)) + 1, index))
+	displacements = [0] * bucket_count
+	slots = [None] * slot_count
+
+	# Place the largest buckets first, while most slots are still free.
+	free_slots = None
+	for bucket_id in sorted(range(bucket_count), key=lambda bucket_id: -len(buckets[bucket_id])):
+		bucket = buckets[bucket_id]
+		if len(bucket) == 0:
+			break
+		elif len(bucket) == 1:
+			if free_slots == None:
+				free_slots = iter([slot for slot in range(slot_count) if slots[slot] == None])
+			slot = next(free_slots)
+			displacements[bucket_id] = 0x8000 | slot
+			slots[slot] = bucket[0][2]
+			continue
+
+		first_f, first_g, first_index = bucket[0]
+		for displacement in range(slot_count):
+			# Quickly skip displacements where the first key's slot is taken.
+			if slots[(first_f + (displacement * first_g)) % slot_count] != None:
+				continue
+			bucket_slots = [(f + (displacement * g)) % slot_count for f, g, index in bucket]
+			if len(set(bucket_slots)) == len(bucket_slots) and all(slots[slot] == None for slot in bucket_slots):
+				break
+		else:
+			return None, None
+		displacements[bucket_id] = displacement
+		for slot, (f, g, index) in zip(bucket_slots, bucket):
+			slots[slot] = index
+
+	return displacements, slots
+
+def build_token_db(strings):
+	# Build a dictionary of the words which save the most bytes when replaced
+	# by 1-byte tokens (0x08-0x1F) or 2-byte tokens (0x01-0x07 followed by
+	# 0x01-0xFF), and tokenize the strings with it. Words carry their leading
+	# space, and must be at least 3 characters long to be worth a token. Each
+	# tokenized string is returned as a tuple of 1-byte characters and 1-byte
+	# or 2-byte tokens, so that tails are only shared on token boundaries.
+	word_re = re.compile(b' ?[A-Za-z0-9]+|[^A-Za-z0-9]')
+	word_counts = collections.Counter(word for s in strings for word in word_re.findall(s) if len(word) >= 3)
+	def top_words(code_length, count, exclude):
+		gains = [(word_count * (len(word) - code_length) - (len(word) + 1), word) for word, word_count in word_counts.items() if word not in exclude]
+		return [word for gain, word in sorted(gains, key=lambda x: (-x[0], x[1]))[:count] if gain > 0]
+	tokens = top_words(1, TOKEN_1BYTE_COUNT, ())
+	tokens += top_words(2, TOKEN_2BYTE_COUNT, set(tokens))
+
+	# Assign token codes.
+	token_codes = {}
+	for token_id, token in enumerate(tokens):
+		if token_id < TOKEN_1BYTE_COUNT:
+			token_codes[token] = bytes([TOKEN_1BYTE_FIRST + token_id])
+		else:
+			token_id -= TOKEN_1BYTE_COUNT
+			token_codes[token] = bytes([1 + (token_id // 255), 1 + (token_id % 255)])
+
+	# Tokenize strings.
+	tokenized_strings = []
+	for s in strings:
+		units = []
+		for word in word_re.findall(s):
+			if word in token_codes:
+				units.append(token_codes[word])
+			else:
+				units += [word[i:i + 1] for i in range(len(word))]
+		tokenized_strings.append(tuple(units))
+
+	# The dictionary is a token count followed by NUL-terminated tokens,
+	# which pcireg indexes with 16-bit offsets.
+	token_db = struct.pack('<H', len(tokens)) + b''.join(token + b'\x00' for token in tokens)
+	if len(token_db) > 0xffff:
+		raise Exception('Token dictionary too large')
+	return token_db, tokenized_strings
+
+def build_string_db(strings):
+	# Build a NUL-terminated string pool, storing every string which is the tail
+	# of a longer string as part of that longer string. Sorting the reversed
+	# strings places each string right before the strings it's the tail of, so
+	# all possible tail merges are found in O(n log n). The remaining strings are
+	# laid out in their order of first use, which compresses best with LHA.
+	# Strings are tuples of tokenized units, and tails must start on a unit.
+	reversed_strings = sorted((s[::-1], string_id) for string_id, s in enumerate(strings))
+	owners = [None] * len(strings)
+	for i in range(len(reversed_strings) - 1, -1, -1):
+		reversed_string, string_id = reversed_strings[i]
+		if i + 1 < len(reversed_strings) and reversed_strings[i + 1][0][:len(reversed_string)] == reversed_string:
+			owners[string_id] = owners[reversed_strings[i + 1][1]]
+		else:
+			owners[string_id] = string_id
+
+	# Lay out the remaining strings, then point tails to the strings which contain them.
+	strings = [b''.join(s) for s in strings]
+	string_db = bytearray()
+	string_offsets = [None] * len(strings)
+	for string_id, s in enumerate(strings):
+		if owners[string_id] == string_id:
+			string_offsets[string_id] = len(string_db)
+			string_db += s + b'\x00'
+	for string_id, s in enumerate(strings):
+		owner_id = owners[string_id]
+		string_offsets[string_id] = string_offsets[owner_id] + len(strings[owner_id]) - len(s)
+
+	return bytes(string_db), string_offsets
+
+def build_hash(entries, index_format='H'):
+	# Build a CHD-style minimal perfect hash over (key, index) entries. Keys are
+	# distributed over buckets of ~4 entries, then each bucket is assigned a
+	# displacement d placing all of its keys on free slots (f + d * g) % slots,
+	# where f and g are further hashes of the key. Single-key buckets are pointed
+	# directly at a free slot with bit 15 set in their displacement value. The
+	# slot count is rounded up to a prime, so that every g reaches every slot;
+	# the few spare slots point to entry 0, which fails the key check on lookup.
+	slot_count = max(2, len(entries))
+	while any((slot_count % i) == 0 for i in range(2, int(slot_count ** 0.5) + 1)):
+		slot_count += 1
+	if slot_count > 0x8000:
+		raise Exception('Too many entries for perfect hash')
+	bucket_count = max(1, (len(entries) + 3) // 4)
+	while True:
+		displacements, slots = place_hash_buckets(entries, bucket_count, slot_count)
+		if slots:
+			break
+
+		# Try again with a different bucket distribution if a bucket could not be placed.
+		bucket_count += 1
+
+	slots = [(index or 0) for index in slots]
+	return struct.pack('<HH', bucket_count, slot_count) + struct.pack('<' + ('H' * bucket_count), *displacements) + struct.pack('<' + (index_format * slot_count), *slots)
+
+def build_class_index(class_ids, subclass_ids, progif_ids):
+	# Build a direct index over the class tables: the class entry for each of
+	# the 256 class IDs (0xffff if none), the range of subclass entries for each
+	# class ID, and the range of progif entries for each subclass entry. Ranges
+	# are stored as the first entry of each one, plus the end of the last one.
+	if max(len(class_ids), len(subclass_ids), len(progif_ids)) >= 0xffff:
+		raise Exception('Too many classes for class index')
+	class_entries = [0xffff] * 256
+	for class_entry, class_id in enumerate(class_ids):
+		class_entries[class_id] = class_entry
+	subclass_ranges = [bisect.bisect_left(subclass_ids, class_id << 8) for class_id in range(257)]
+	progif_ranges = [bisect.bisect_left(progif_ids, subclass_id << 8) for subclass_id in subclass_ids] + [len(progif_ids)]
+	index = class_entries + subclass_ranges + progif_ranges
+	return struct.pack('<H', len(subclass_ids)) + struct.pack('<' + ('H' * len(index)), *index)
+
+def write_embedded_db(file_name, dbs):
+	# Write a C source file with each database as a const byte array, plus the
+	# pciids_embedded table which pcireg's PCIIDS_EMBEDDED build looks them up on.
+	with open(file_name, 'w') as f:
+		f.write('/* Generated by pciids.py -c, do not edit. */\n')
+		for fn, db in dbs:
+			f.write('\nstatic const unsigned char pciids_db_{0}[{1}] = {{\n'.format(fn, max(len(db), 1)))
+			for pos in range(0, len(db), 16):
+				f.write('\t' + ''.join('0x{0:02x},'.format(b) for b in db[pos:pos + 16]) + '\n')
+			f.write('};\n')
+		f.write('\nconst struct {\n\tchar id;\n\tconst unsigned char *data;\n\tunsigned long size;\n} pciids_embedded[] = {\n')
+		for fn, db in dbs:
+			f.write('\t{{ \'{0}\', pciids_db_{0}, {1} }},\n'.format(fn, len(db)))
+		f.write('\t{ 0, 0, 0 }\n};\n')
+
+def write_archive(file_name, db_file_names):
+	# Compress the databases with lh5pack, which is built (or rebuilt if its
+	# source has changed) from alongside this script. -lh7- is used for its
+	# larger dictionary. Returns False if lh5pack could not be built or run.
+	tool_dir = os.path.dirname(os.path.abspath(__file__))
+	lh5pack = os.path.join(tool_dir, 'lh5pack' + ('.exe' if sys.platform == 'win32' else ''))
+	try:
+		subprocess.run(['make', '-s', '-f', 'Makefile.lh5pack'], cwd=tool_dir, check=True)
+	except (OSError, subprocess.CalledProcessError):
+		if not os.path.exists(lh5pack):
+			return False
+	try:
+		subprocess.run([lh5pack, '-m7', file_name] + db_file_names, check=True)
+	except (OSError, subprocess.CalledProcessError):
+		return False
+	return True
 
 def main():
 	# Load PCI ID database.
@@ -23,23 +222,30 @@ def main():
 	pciutil.load_pci_db()
 
 	# Start databases.
-	vendor_db = device_db = subdevice_db = class_db = subclass_db = progif_db = string_db = b''
+	vendor_db = device_db = subdevice_db = class_db = subclass_db = progif_db = b''
 	vendor_devices_offset = {}
+	vendor_hash_entries = []
+	vendor_devices_offsets = []
+	device_hash_entries = []
 	device_db_pos = subdevice_db_pos = 0
 	vendor_has_termination = device_has_termination = class_has_termination = subclass_has_termination = progif_has_termination = False
 
+	strings = {}
+
 	def string_db_add(s):
+		# Return a string ID to be replaced with the string's offset once the
+		# string database is built, as tails can only be shared with strings
+		# which haven't been seen yet.
 		if not s:
 			return 0xffffffff
-		nonlocal string_db
-		# This basic trailing substring detection appears to be the best optimization
-		# we can do for our LHA-compressed target. Ideally, we'd sort the strings by
-		# descending length beforehand, but that resulted in much worse compression.
-		string_db_pos = string_db.find(s + b'\x00')
-		if string_db_pos == -1:
-			string_db_pos = len(string_db)
-			string_db += s + b'\x00'
-		return string_db_pos
+		# Control characters are reserved for tokens.
+		s = bytes(c for c in s if c >= 0x20)
+		return strings.setdefault(s, len(strings))
+
+	# Clean all device and subdevice names at once, as it's the slowest step.
+	# Names are cached per vendor, so that only changed vendors are cleaned again.
+	print('Cleaning names...')
+	clean_device_names = pciutil.clean_pci_db_devices('pciids.cache')
 
 	# Enumerate device IDs, while also going through subdevice IDs.
 	print('Enumerating devices and subdevices...')
@@ -68,7 +274,7 @@ def main():
 				vendor_devices_offset[subvendor_id] = None
 
 			# Look up subdevice ID.
-			subdevice = pciutil.clean_device(pciutil._pci_subdevices[pci_id][pci_subid]).encode('cp437', 'ignore')[:256]
+			subdevice = clean_device_names[pciutil._pci_subdevices[pci_id][pci_subid]].encode('cp437', 'ignore')[:256]
 
 			# Add to string database if a valid result was found.
 			string_db_pos = string_db_add(subdevice)
@@ -88,12 +294,13 @@ def main():
 			subdevice_db_pos_start = 0xffffffff
 
 		# Look up device ID.
-		device = pciutil.clean_device(pciutil._pci_devices[pci_id]).encode('cp437', 'ignore')[:256]
+		device = clean_device_names[pciutil._pci_devices[pci_id]].encode('cp437', 'ignore')[:256]
 
 		# Add to string database if a valid result was found.
 		string_db_pos = string_db_add(device)
 
 		# Add to device database.
+		device_hash_entries.append((pci_id, device_db_pos))
 		device_db += struct.pack('<HII', pci_id & 0xffff, subdevice_db_pos_start, string_db_pos)
 		device_db_pos += 1
 		device_has_termination = (pci_id & 0xffff) == 0xffff
@@ -112,6 +319,9 @@ def main():
 		if devices_offset == None:
 			devices_offset = 0xffffffff
 		if string_db_pos != 0xffffffff or devices_offset != 0xffffffff:
+			vendor_hash_entries.append((vendor_id, len(vendor_db) // 10))
+			if devices_offset != 0xffffffff:
+				vendor_devices_offsets.append(devices_offset)
 			vendor_db += struct.pack('<HII', vendor_id, devices_offset, string_db_pos)
 			vendor_has_termination = vendor_id == 0xffff
 
@@ -154,6 +364,40 @@ def main():
 		progif_db += struct.pack('<BBBI', (pci_progif >> 16) & 0xff, (pci_progif >> 8) & 0xff, pci_progif & 0xff, string_db_pos)
 		progif_has_termination = pci_progif == 0xffffff
 
+	# Build token and string databases.
+	print('Building string database...')
+	token_db, tokenized_strings = build_token_db(list(strings))
+	string_db, string_offsets = build_string_db(tokenized_strings)
+
+	# Replace string IDs with offsets. The string offset is the last field of every entry type.
+	def string_db_patch(db, entry_length):
+		db = bytearray(db)
+		for entry_pos in range(entry_length - 4, len(db), entry_length):
+			string_id, = struct.unpack_from('<I', db, entry_pos)
+			if string_id != 0xffffffff:
+				struct.pack_into('<I', db, entry_pos, string_offsets[string_id])
+		return bytes(db)
+	vendor_db = string_db_patch(vendor_db, 10)
+	device_db = string_db_patch(device_db, 10)
+	subdevice_db = string_db_patch(subdevice_db, 8)
+	class_db = string_db_patch(class_db, 5)
+	subclass_db = string_db_patch(subclass_db, 6)
+	progif_db = string_db_patch(progif_db, 7)
+
+	# Build perfect hashes for vendor and vendor:device lookups. The device hash
+	# only stores the low byte of each entry's index within its vendor's device
+	# entries, which pcireg bounds by where the next vendor's entries start. The
+	# last vendor's entries have no such bound, so they're left out as well.
+	print('Building hash tables...')
+	vendor_hash_db = build_hash(vendor_hash_entries)
+	vendor_devices_end = dict(zip(vendor_devices_offsets, vendor_devices_offsets[1:]))
+	device_hash_entries = [(pci_id, (index - vendor_devices_offset[pci_id >> 16]) & 0xff) for pci_id, index in device_hash_entries
+		if (vendor_devices_end.get(vendor_devices_offset[pci_id >> 16], 0) - vendor_devices_offset[pci_id >> 16]) > HASH_MIN_DEVICES]
+	device_hash_db = build_hash(device_hash_entries, 'B')
+
+	# Build direct index for class, subclass and progif lookups.
+	class_index_db = build_class_index(sorted(pciutil._pci_classes), sorted(pciutil._pci_subclasses), sorted(pciutil._pci_progifs))
+
 	# Create binary files.
 	print('Writing binary databases...')
 
@@ -166,14 +410,30 @@ def main():
 		('U', subclass_db, 6, subclass_has_termination),
 		('P', progif_db, 7, progif_has_termination),
 		('T', string_db, None, True),
+		('K', token_db, None, True),
+		('H', vendor_hash_db, None, True),
+		('I', device_hash_db, None, True),
+		('X', class_index_db, None, True),
 	]
 
 	# Write the databases themselves, adding termination if required.
+	written_dbs = []
 	for fn, db, entry_length, has_termination in dbs:
+		if not has_termination:
+			db += b'\xff' * entry_length
 		with open('PCIIDS_' + fn + '.BIN', 'wb') as f:
 			f.write(db)
-			if not has_termination:
-				f.write(b'\xff' * entry_length)
+		written_dbs.append((fn, db))
+
+	# Compress the databases into the archive read by pcireg.
+	print('Compressing databases...')
+	if not write_archive('PCIIDS.LHA', ['PCIIDS_' + fn + '.BIN' for fn, db in written_dbs]):
+		print('Could not build or run lh5pack, compress the databases with: lha a1o7 PCIIDS.LHA PCIIDS_*.BIN')
+
+	# Write the databases as a C source file as well if requested, for building them into pcireg.
+	if '-c' in sys.argv[1:]:
+		print('Writing embedded database source...')
+		write_embedded_db('pciids_db.c', written_dbs)
 
 if __name__ == '__main__':
 	main()
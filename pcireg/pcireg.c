@@ -31,6 +31,15 @@
 #    if defined(__DOS__) || defined(__PMODEW__)
 #        include <dos.h>
 #        include <i86.h>
+#    else
+#        include <sys/stat.h>
+#        include <pthread.h>
+#        ifdef _WIN32
+#            include <direct.h>
+#            include <process.h>
+#        else
+#            include <unistd.h>
+#        endif
 #    endif
 #endif
 #include "lh5_extract.h"
@@ -100,6 +109,23 @@ static const char *bridge_flags[] = {
     NULL
 };
 
+#define PCIIDS_OPTIONAL     "HIKX" /* databases which may be missing from older archives */
+#define PCIIDS_TOKEN_1BYTE  0x08  /* 1-byte tokens 08-1F, 2-byte tokens 01-07 followed by 01-FF */
+#define PCIIDS_TOKEN_COUNT  ((0x20 - PCIIDS_TOKEN_1BYTE) + ((PCIIDS_TOKEN_1BYTE - 1) * 255))
+#define PCIIDS_CHUNK_SIZE   4096 /* compressed data is read in chunks of this size */
+#define PCIIDS_HASH_MIN_DEV 16   /* vendors with up to this many device entries are scanned instead of hashed, must match pciids.py */
+#if !defined(__DOS__) && !defined(__PMODEW__) && !defined(PCIIDS_EMBEDDED)
+#    define PCIIDS_CACHE       1
+#    define PCIIDS_CACHE_MAGIC "PCIIDC1"
+#    define PCIIDS_CACHE_PATH  512 /* cache file path buffer size */
+#    ifndef __POSIX_UEFI__
+#        define PCIIDS_PRELOAD         1
+#        define PCIIDS_PRELOAD_THREADS 4  /* threads decoding databases in the background */
+#        define PCIIDS_PRELOAD_MAX     16 /* archive members which can be queued */
+#        define PCIIDS_PRELOAD_IDS     "VDTKHI" /* databases used by bus scan name lookups */
+#    endif
+#endif
+
 static int   term_width;
 #if defined(__DOS__) || defined(__PMODEW__)
 static union REGS   regs;
@@ -115,9 +141,7 @@ static struct PACKED {
 static int   pciids_cur_vendor = -1;
 static int   pciids_cur_device = -1;
 static char *pciids_lookup;
-#ifdef PCI_LIB_VERSION
 static char  pciids_buf[256];
-#endif
 #pragma pack(push, 1)
 static struct PACKED {
     uint16_t vendor_id;
@@ -150,6 +174,55 @@ static struct PACKED {
     uint32_t string_offset;
 } *pciids_progif = NULL;
 static char *pciids_string = NULL;
+typedef struct PACKED {
+    uint16_t count;
+    char     data[1]; /* NUL-terminated tokens */
+} pciids_tokens_t;
+static pciids_tokens_t *pciids_token_db = NULL;
+static pciids_tokens_t  pciids_no_tokens = { 0 };
+static uint16_t         pciids_token[PCIIDS_TOKEN_COUNT];
+static uint16_t         pciids_token_count;
+typedef struct PACKED {
+    uint16_t buckets;
+    uint16_t slots;
+    uint16_t data[1]; /* displacements[buckets] followed by slots[slots], see pciids_get_{vendor|device} */
+} pciids_hash_t;
+static pciids_hash_t *pciids_vendor_hash = NULL;
+static pciids_hash_t *pciids_device_hash = NULL;
+static pciids_hash_t  pciids_no_hash     = { 0 };
+typedef struct PACKED {
+    uint16_t subclasses;
+    uint16_t data[1]; /* class entries[256], subclass ranges[257] and progif ranges[subclasses + 1] */
+} pciids_class_index_t;
+static pciids_class_index_t *pciids_class_index    = NULL;
+static pciids_class_index_t  pciids_no_class_index = { 0 };
+#ifdef PCIIDS_CACHE
+typedef struct PACKED {
+    char     magic[8];
+    uint32_t archive_size;
+    uint32_t archive_mtime;
+    uint32_t original_size;
+    uint16_t crc;
+} pciids_cache_header_t;
+#endif
+#ifdef PCIIDS_PRELOAD
+typedef struct {
+    char         id;
+    unsigned int size;
+    int          state; /* PCIIDS_FUTURE_* */
+    int          ret;
+    void        *ptr;
+} pciids_future_t;
+#    define PCIIDS_FUTURE_QUEUED   0
+#    define PCIIDS_FUTURE_DECODING 1
+#    define PCIIDS_FUTURE_DONE     2
+static pciids_future_t pciids_future[PCIIDS_PRELOAD_MAX];
+static int             pciids_future_count = 0;
+static pthread_t       pciids_preload_threads[PCIIDS_PRELOAD_THREADS];
+static int             pciids_preload_thread_count = 0;
+static pthread_mutex_t pciids_future_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pciids_future_done  = PTHREAD_COND_INITIALIZER;
+#endif
 
 #if defined(__DOS__) || defined(__PMODEW__)
 typedef struct {
@@ -172,8 +245,215 @@ typedef struct {
 #endif
 #pragma pack(pop)
 
+#ifdef PCIIDS_EMBEDDED
+typedef struct {
+    char                 id;
+    const unsigned char *data;
+    unsigned long        size;
+} pciids_embedded_t;
+extern const pciids_embedded_t pciids_embedded[]; /* generated by pciids.py -c */
+#endif
+
+#ifdef PCIIDS_CACHE
+static int
+pciids_cache_path(char *path, char id, int create)
+{
+#    ifdef __POSIX_UEFI__
+    /* There are no user profiles, so keep the cache alongside the archive. */
+    path[0] = '\0';
+#    else
+    char *base, *p;
+    int   i;
+
+    /* Determine the per-user cache directory. */
+#        ifdef _WIN32
+    base = getenv("LOCALAPPDATA");
+    if (!base || !base[0] || ((strlen(base) + 32) > PCIIDS_CACHE_PATH))
+        return 1;
+    sprintf(path, "%s\\pcireg\\", base);
+#        else
+    base = getenv("XDG_CACHE_HOME");
+    if (base && base[0] && ((strlen(base) + 32) <= PCIIDS_CACHE_PATH)) {
+        sprintf(path, "%s/pcireg/", base);
+    } else {
+        base = getenv("HOME");
+        if (!base || !base[0] || ((strlen(base) + 32) > PCIIDS_CACHE_PATH))
+            return 1;
+        sprintf(path, "%s/.cache/pcireg/", base);
+    }
+#        endif
+
+    /* Create any missing directories if we're about to write. */
+    if (create) {
+        for (p = &path[1]; *p; p++) {
+            if ((*p != '/') && (*p != '\\'))
+                continue;
+            i  = *p;
+            *p = '\0';
+#        ifdef _WIN32
+            _mkdir(path);
+#        else
+            mkdir(path, 0755);
+#        endif
+            *p = i;
+        }
+    }
+#    endif
+
+    /* Add cache file name. */
+    sprintf(&path[strlen(path)], "PCIIDS_%c.CAC", id);
+    return 0;
+}
+
+static int
+pciids_cache_read(void **ptr, char id, pciids_cache_header_t *key)
+{
+    char                  path[PCIIDS_CACHE_PATH];
+    FILE                 *f;
+    pciids_cache_header_t header;
+
+    /* Open cache file, and stop if it doesn't exist. */
+    if (pciids_cache_path(path, id, 0))
+        return 1;
+    f = fopen(path, "r" FOPEN_BINARY);
+    if (!f)
+        return 1;
+
+    /* Read the whole image in one go if the header matches this archive member,
+       and only trust it if it's intact, as the file may be shared or damaged. */
+    if (fread(&header, sizeof(header), 1, f) && !memcmp(&header, key, sizeof(header))) {
+        *ptr = arena_alloc(key->original_size);
+        if (*ptr) {
+            if (fread(*ptr, key->original_size, 1, f) && (CRC16Calculate(*ptr, key->original_size) == key->crc)) {
+                fclose(f);
+                return 0;
+            }
+            arena_free(*ptr);
+            *ptr = NULL;
+        }
+    }
+
+    fclose(f);
+    return 1;
+}
+
+static void
+pciids_cache_write(void *ptr, char id, pciids_cache_header_t *key)
+{
+    char  path[PCIIDS_CACHE_PATH], temp_path[PCIIDS_CACHE_PATH + 16];
+    FILE *f;
+    int   ok;
+
+    /* Write to a temporary file unique to this process, and stop if it couldn't be created. */
+    if (pciids_cache_path(path, id, 1))
+        return;
+#    ifdef __POSIX_UEFI__
+    sprintf(temp_path, "%s.TMP", path);
+#    elif defined(_WIN32)
+    sprintf(temp_path, "%s.%d", path, _getpid());
+#    else
+    sprintf(temp_path, "%s.%d", path, (int) getpid());
+#    endif
+    f = fopen(temp_path, "w" FOPEN_BINARY);
+    if (!f)
+        return;
+    ok = fwrite(key, sizeof(*key), 1, f) && fwrite(ptr, key->original_size, 1, f);
+
+    /* Closing flushes the buffered tail, which can fail as well (on a full disk, for instance). */
+#    ifdef __POSIX_UEFI__
+    if (!fclose(f)) /* POSIX-UEFI's fclose returns 1 on success */
+#    else
+    if (fclose(f))
+#    endif
+        ok = 0;
+
+    /* Move the complete file into place, so that other processes
+       sharing the cache never see a partially written one. */
+#    ifdef _WIN32
+    if (ok)
+        remove(path); /* rename doesn't replace existing files */
+#    endif
+    if (!ok || rename(temp_path, path))
+        remove(temp_path);
+}
+#endif
+
+#ifdef PCIIDS_EMBEDDED
 static int
 pciids_open_database(void **ptr, char id)
+{
+    const pciids_embedded_t *db;
+
+    /* No action is required if the database is already loaded. */
+    if (*ptr)
+        return 0;
+
+    /* Point to the embedded database. It's read-only and must never be freed. */
+    for (db = pciids_embedded; db->id; db++) {
+        if (db->id == id) {
+            *ptr = (void *) db->data;
+            return 0;
+        }
+    }
+
+    /* Entry not found. */
+    if (!strchr(PCIIDS_OPTIONAL, id))
+        printf("PCI ID database %c not embedded\n", id);
+    return 1;
+}
+#else
+static int
+pciids_decode(FILE *f, uint8_t *buf, unsigned int packed_size, uint8_t *out, unsigned int original_size, unsigned short crc, unsigned char method)
+{
+    LH5Context  *ctx;
+    unsigned int produced = 0, chunk_pos = 0, chunk_size = 0;
+    int          n, eof = 0, ret = 0;
+
+    /* Decoder state is too large for the stack on some targets. */
+    ctx = arena_alloc(sizeof(LH5Context));
+    if (!ctx)
+        return 1;
+
+    /* Read compressed data in chunks, decompressing it straight into the output buffer. */
+    if (LH5StreamInit(ctx, original_size, crc, method)) {
+        arena_free(ctx);
+        return 1;
+    }
+    while (produced < original_size) {
+        /* Feed the decoder with the next chunk, or mark the end of the compressed data. */
+        if ((chunk_pos == chunk_size) && packed_size) {
+            chunk_size = MIN(packed_size, PCIIDS_CHUNK_SIZE);
+            if (!fread(buf, chunk_size, 1, f)) {
+                ret = 1;
+                break;
+            }
+            packed_size -= chunk_size;
+            chunk_pos = 0;
+        }
+        if (chunk_pos < chunk_size) {
+            chunk_pos += LH5StreamFeed(ctx, buf + chunk_pos, chunk_size - chunk_pos);
+        } else if (!eof) {
+            eof = !LH5StreamFeed(ctx, NULL, 0);
+        } else {
+            ret = 1; /* compressed data ended before the decompressed data */
+            break;
+        }
+
+        /* Decompress as much as possible. The CRC is checked once everything is decompressed. */
+        n = LH5StreamDrain(ctx, out + produced, original_size - produced);
+        if (n < 0) {
+            ret = 1;
+            break;
+        }
+        produced += n;
+    }
+
+    arena_free(ctx);
+    return ret;
+}
+
+static int
+pciids_read_database(void **ptr, char id)
 {
     FILE          *f;
     size_t         pos;
@@ -186,11 +466,11 @@ pciids_open_database(void **ptr, char id)
     unsigned short crc;
     unsigned char  method;
     uint8_t       *buf = NULL;
-
-    /* No action is required if the database is already loaded. */
-    if (*ptr)
-        return 0;
-    fflush(stdout);
+    int            match;
+#ifdef PCIIDS_CACHE
+    pciids_cache_header_t cache_key;
+    struct stat           st;
+#endif
 
     /* Generate target filename. */
     strcpy(target_filename, "PCIIDS_@.BIN");
@@ -205,10 +485,25 @@ pciids_open_database(void **ptr, char id)
         fseek(f, 0, SEEK_END);
         original_size = packed_size = ftell(f);
         fseek(f, 0, SEEK_SET);
+        pos = header_size = 0; /* no header, and therefore no CRC to check */
         method = '0';
         goto found;
     }
 
+#ifdef PCIIDS_CACHE
+    /* Key the decoded image cache on the archive's size and modification time. */
+    memset(&cache_key, 0, sizeof(cache_key));
+#    ifdef __POSIX_UEFI__
+    if (!fstat(f, &st)) {
+#    else
+    if (!fstat(fileno(f), &st)) {
+#    endif
+        memcpy(cache_key.magic, PCIIDS_CACHE_MAGIC, sizeof(cache_key.magic));
+        cache_key.archive_size  = st.st_size;
+        cache_key.archive_mtime = st.st_mtime;
+    }
+#endif
+
     /* Go through archive. */
     while (!feof(f)) {
         /* Read LHA header. */
@@ -222,29 +517,51 @@ pciids_open_database(void **ptr, char id)
             break; /* invalid header */
 
         /* Check filename. */
-        crc = !strcmp(filename, target_filename);
+        match = !strcmp(filename, target_filename);
         free(filename);
-        if (crc) {
+        if (match) {
+#ifdef PCIIDS_CACHE
+            /* Load the decoded image from cache if it matches this archive member. */
+            cache_key.original_size = original_size;
+            cache_key.crc           = crc;
+            if (cache_key.magic[0] && !pciids_cache_read(ptr, id, &cache_key)) {
+                fclose(f);
+                return 0;
+            }
+#endif
 found:
-            /* Allocate buffers for the compressed and decompressed data. */
-            *ptr = malloc(original_size);
+            /* Allocate buffers for the decompressed data and for reading compressed data in chunks.
+               The database lives for the whole run, while the temporary buffers are freed in reverse
+               order, which gives their space back to the arena. */
+            *ptr = arena_alloc(original_size);
             if (!*ptr)
                 goto fail;
-            buf = (method != '0') ? malloc(packed_size) : *ptr;
+            buf = (method != '0') ? arena_alloc(PCIIDS_CHUNK_SIZE) : *ptr;
             if (!buf)
                 goto fail;
 
             /* Read and optionally decompress data. */
             fseek(f, pos + header_size, SEEK_SET);
-            if (!fread(buf, packed_size, 1, f))
-                goto fail;
-            if ((method != '0') && (LH5Decode(buf, packed_size, *ptr, original_size) == -1))
-                goto fail;
+            if (method != '0') {
+                if (pciids_decode(f, buf, packed_size, *ptr, original_size, crc, method))
+                    goto fail;
+            } else {
+                if (!fread(buf, packed_size, 1, f))
+                    goto fail;
+                if (header_size && (CRC16Calculate(*ptr, original_size) != crc))
+                    goto fail;
+            }
 
             /* All done, close archive. */
             fclose(f);
-            if (method != '0')
-                free(buf);
+            if (method != '0') {
+                arena_free(buf);
+#ifdef PCIIDS_CACHE
+                /* Save the decoded image to cache. */
+                if (cache_key.magic[0])
+                    pciids_cache_write(*ptr, id, &cache_key);
+#endif
+            }
             return 0;
         }
 
@@ -252,22 +569,228 @@ found:
         fseek(f, pos + header_size + packed_size, SEEK_SET);
     }
 
+    /* Fail silently if an optional database is not present. */
+    if (strchr(PCIIDS_OPTIONAL, id)) {
+        fclose(f);
+        return 1;
+    }
+
 fail:
-    /* Entry not found or read/decompression failed. */
-    printf("PCI ID database %c decompression failed\n", id);
+    /* Entry not found or read/decompression failed. This may run on a preload
+       thread, so the failure is reported by pciids_open_database instead. */
     fclose(f);
+    if (buf && (buf != *ptr))
+        arena_free(buf);
     if (*ptr) {
-        free(*ptr);
+        arena_free(*ptr);
         *ptr = NULL;
     }
-    if (buf)
-        free(buf);
-    return 1;
+    return 2;
+}
+
+#    ifdef PCIIDS_PRELOAD
+static void *
+pciids_preload_thread(void *arg)
+{
+    pciids_future_t *future;
+    void            *ptr;
+    int              i, ret;
+
+    /* Decode queued databases until none are left. */
+    pthread_mutex_lock(&pciids_future_lock);
+    for (i = 0; i < pciids_future_count; i++) {
+        future = &pciids_future[i];
+        if (future->state != PCIIDS_FUTURE_QUEUED)
+            continue;
+        future->state = PCIIDS_FUTURE_DECODING;
+        pthread_mutex_unlock(&pciids_future_lock);
+
+        ptr = NULL;
+        ret = pciids_read_database(&ptr, future->id);
+
+        /* Hand the result over to whoever is waiting for it. */
+        pthread_mutex_lock(&pciids_future_lock);
+        future->ptr   = ptr;
+        future->ret   = ret;
+        future->state = PCIIDS_FUTURE_DONE;
+        pthread_cond_broadcast(&pciids_future_done);
+    }
+    pthread_mutex_unlock(&pciids_future_lock);
+
+    return NULL;
+}
+
+static void
+pciids_preload(void)
+{
+    FILE          *f;
+    size_t         pos;
+    unsigned int   header_size;
+    unsigned int   original_size;
+    unsigned int   packed_size;
+    uint8_t        header[128];
+    char          *filename;
+    unsigned short crc;
+    unsigned char  method;
+    int            i, threads;
+
+    /* Open archive, and stop if there is none. */
+    f = fopen("PCIIDS.LHA", "r" FOPEN_BINARY);
+    if (!f)
+        return;
+
+    /* Queue the databases used by the bus scan, largest first so that it doesn't hold up the end. */
+    while (!feof(f) && (pciids_future_count < PCIIDS_PRELOAD_MAX)) {
+        /* Read and parse LHA header. */
+        pos = ftell(f);
+        if (!fread(header, sizeof(header), 1, f))
+            break;
+        header_size = LH5HeaderParse(header, sizeof(header), &original_size, &packed_size, &filename, &crc, &method);
+        if (!header_size)
+            break; /* invalid header */
+
+        /* Insert database by size. */
+        if ((strlen(filename) == 12) && !memcmp(filename, "PCIIDS_", 7) && !strcmp(&filename[8], ".BIN") && strchr(PCIIDS_PRELOAD_IDS, filename[7])) {
+            for (i = pciids_future_count++; (i > 0) && (pciids_future[i - 1].size < packed_size); i--)
+                pciids_future[i] = pciids_future[i - 1];
+            memset(&pciids_future[i], 0, sizeof(pciids_future[i]));
+            pciids_future[i].id   = filename[7];
+            pciids_future[i].size = packed_size;
+        }
+        free(filename);
+
+        /* Move on to the next header. */
+        fseek(f, pos + header_size + packed_size, SEEK_SET);
+    }
+    fclose(f);
+
+    /* Start decoding threads. */
+    threads = MIN(pciids_future_count, PCIIDS_PRELOAD_THREADS);
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&pciids_preload_threads[i], NULL, pciids_preload_thread, NULL))
+            break; /* any databases left over will be decoded on demand */
+        pciids_preload_thread_count++;
+    }
+}
+
+static void
+pciids_preload_join(void)
+{
+    int i;
+
+    /* Take databases no thread got to yet off the queue. */
+    pthread_mutex_lock(&pciids_future_lock);
+    for (i = 0; i < pciids_future_count; i++) {
+        if (pciids_future[i].state == PCIIDS_FUTURE_QUEUED) {
+            pciids_future[i].ret   = 1;
+            pciids_future[i].state = PCIIDS_FUTURE_DONE;
+        }
+    }
+    pthread_mutex_unlock(&pciids_future_lock);
+
+    /* Wait for decodes in progress, so that no cache file is left half written. */
+    for (i = 0; i < pciids_preload_thread_count; i++)
+        pthread_join(pciids_preload_threads[i], NULL);
+    pciids_preload_thread_count = 0;
+}
+
+static int
+pciids_preload_get(void **ptr, char id)
+{
+    pciids_future_t *future = NULL;
+    int              i, ret;
+
+    /* Find this database's future, and stop if it wasn't queued. */
+    for (i = 0; i < pciids_future_count; i++) {
+        if (pciids_future[i].id == id) {
+            future = &pciids_future[i];
+            break;
+        }
+    }
+    if (!future)
+        return -1;
+
+    pthread_mutex_lock(&pciids_future_lock);
+    if (future->state == PCIIDS_FUTURE_QUEUED) {
+        /* No thread got to it yet, so decode it here instead of waiting. */
+        future->state = PCIIDS_FUTURE_DECODING;
+        pthread_mutex_unlock(&pciids_future_lock);
+        ret = pciids_read_database(&future->ptr, id);
+        pthread_mutex_lock(&pciids_future_lock);
+        future->ret   = ret;
+        future->state = PCIIDS_FUTURE_DONE;
+    }
+
+    /* Wait for a thread to finish decoding it. */
+    while (future->state != PCIIDS_FUTURE_DONE)
+        pthread_cond_wait(&pciids_future_done, &pciids_future_lock);
+    *ptr = future->ptr;
+    ret  = future->ret;
+    pthread_mutex_unlock(&pciids_future_lock);
+
+    return ret;
+}
+#    endif
+
+static int
+pciids_open_database(void **ptr, char id)
+{
+    int ret = -1;
+
+    /* No action is required if the database is already loaded. */
+    if (*ptr)
+        return 0;
+    fflush(stdout);
+
+#    ifdef PCIIDS_PRELOAD
+    /* Collect the database if it was queued for decoding in the background. */
+    ret = pciids_preload_get(ptr, id);
+#    endif
+    if (ret < 0)
+        ret = pciids_read_database(ptr, id);
+
+    /* Report failures here, as the database may have been decoded on a preload thread. */
+    if (ret == 2) {
+        printf("PCI ID database %c decompression failed\n", id);
+        ret = 1;
+    }
+    return ret;
+}
+#endif
+
+static int
+pciids_open_tokens(void)
+{
+    uint16_t i;
+    char    *p;
+
+    /* Open database if required. */
+    if (pciids_token_db)
+        return pciids_token_count;
+    if (pciids_open_database((void **) &pciids_token_db, 'K')) {
+        /* Older databases are not tokenized. */
+        pciids_token_db = &pciids_no_tokens;
+        return 0;
+    }
+
+    /* Index the tokens. */
+    pciids_token_count = MIN(pciids_token_db->count, PCIIDS_TOKEN_COUNT);
+    p                  = pciids_token_db->data;
+    for (i = 0; i < pciids_token_count; i++) {
+        pciids_token[i] = p - pciids_token_db->data;
+        p += strlen(p) + 1;
+    }
+
+    return pciids_token_count;
 }
 
 static char *
-pciids_read_string(uint32_t offset)
+pciids_read_string(uint32_t offset, char *buf, int size)
 {
+    uint8_t *p;
+    char    *token;
+    int      i, token_id;
+
     /* Return nothing if the string offset is invalid. */
     if (offset == 0xffffffff)
         return NULL;
@@ -276,16 +799,132 @@ pciids_read_string(uint32_t offset)
     if (pciids_open_database((void **) &pciids_string, 'T'))
         return NULL;
 
-    return &pciids_string[offset];
+    /* Return the string directly if the database is not tokenized. */
+    if (!pciids_open_tokens())
+        return &pciids_string[offset];
+
+    /* Expand tokens into the buffer, leaving room for the terminator. */
+    p = (uint8_t *) &pciids_string[offset];
+    size--;
+    i = 0;
+    while (*p && (i < size)) {
+        /* Copy regular characters. */
+        if (*p >= 0x20) {
+            buf[i++] = *p++;
+            continue;
+        }
+
+        /* Determine the token ID. */
+        if (*p >= PCIIDS_TOKEN_1BYTE) {
+            token_id = *p++ - PCIIDS_TOKEN_1BYTE;
+        } else {
+            token_id = (0x20 - PCIIDS_TOKEN_1BYTE) + ((*p++ - 1) * 255);
+            if (!*p)
+                break;
+            token_id += *p++ - 1;
+        }
+        if (token_id >= pciids_token_count)
+            continue;
+
+        /* Copy the token's characters. */
+        for (token = &pciids_token_db->data[pciids_token[token_id]]; *token && (i < size); token++)
+            buf[i++] = *token;
+    }
+    buf[i] = '\0';
+
+    return buf;
+}
+
+static uint32_t
+pciids_hash(uint32_t key, uint16_t seed)
+{
+    uint32_t hash;
+    int      i;
+
+    /* 32-bit FNV-1a over the key's 4 bytes, with the seed mixed into the basis. Must match pciids.py. */
+    hash = 0x811c9dc5 ^ seed;
+    for (i = 0; i < 4; i++) {
+        hash = (hash ^ (key & 0xff)) * 0x01000193;
+        key >>= 8;
+    }
+
+    return hash;
+}
+
+static int
+pciids_hash_lookup(pciids_hash_t **hash, char id, uint32_t key)
+{
+    uint16_t displacement, slot;
+
+    /* Open database if required, and mark it as missing so that we don't try again. */
+    if (!*hash && pciids_open_database((void **) hash, id))
+        *hash = &pciids_no_hash;
+    if (!(*hash)->slots)
+        return -1;
+
+    /* Look up the key's bucket, which either points to a slot directly or has a displacement to apply. */
+    displacement = (*hash)->data[pciids_hash(key, 0) % (*hash)->buckets];
+    if (displacement & 0x8000)
+        slot = displacement & 0x7fff;
+    else
+        slot = ((pciids_hash(key, 1) % (*hash)->slots) + ((uint32_t) displacement * ((pciids_hash(key, 2) % ((*hash)->slots - 1)) + 1))) % (*hash)->slots;
+
+    /* Return the slot. The caller must check if the entry it points to actually matches the key. */
+    return slot;
+}
+
+static pciids_class_index_t *
+pciids_open_class_index(void)
+{
+    /* Open database if required, and mark it as missing so that we don't try again. */
+    if (!pciids_class_index && pciids_open_database((void **) &pciids_class_index, 'X'))
+        pciids_class_index = &pciids_no_class_index;
+
+    return (pciids_class_index == &pciids_no_class_index) ? NULL : pciids_class_index;
+}
+
+static int
+pciids_find_subclass(uint8_t class_id, uint8_t subclass_id)
+{
+    pciids_class_index_t *index;
+    int                   i, end;
+
+    /* Go through this class' subclass entries if the index is available. */
+    if ((index = pciids_open_class_index())) {
+        end = index->data[256 + class_id + 1];
+        for (i = index->data[256 + class_id]; i < end; i++) {
+            if (pciids_subclass[i].subclass_id == subclass_id)
+                return i;
+        }
+        return -1;
+    }
+
+    /* Go through subclass entries until the ID is matched or overtaken. */
+    for (i = 0; (pciids_subclass[i].class_id < class_id) || (pciids_subclass[i].subclass_id < subclass_id); i++)
+        ;
+
+    /* Return the subclass entry if found. */
+    if ((pciids_subclass[i].class_id == class_id) && (pciids_subclass[i].subclass_id == subclass_id))
+        return i;
+    return -1;
 }
 
 static int
 find_vendor(uint16_t vendor_id)
 {
+    int slot;
+
     /* Open database if required. */
     if (pciids_open_database((void **) &pciids_vendor, 'V'))
         return 0;
 
+    /* Use the hash table if present. Its slots hold vendor entry indexes. */
+    slot = pciids_hash_lookup(&pciids_vendor_hash, 'H', vendor_id);
+    if (slot >= 0) {
+        pciids_cur_vendor = pciids_vendor_hash->data[pciids_vendor_hash->buckets + slot];
+        return pciids_vendor[pciids_cur_vendor].vendor_id == vendor_id;
+    }
+
     /* Go through vendor entries until the ID is matched or overtaken. */
     for (pciids_cur_vendor = 0; pciids_vendor[pciids_cur_vendor].vendor_id < vendor_id; pciids_cur_vendor++)
         ;
@@ -299,11 +938,13 @@ pciids_get_vendor(uint16_t vendor_id)
 {
     /* Find vendor ID in the database, and return its name if found. */
     if (find_vendor(vendor_id))
-        return pciids_read_string(pciids_vendor[pciids_cur_vendor].string_offset);
+        return pciids_read_string(pciids_vendor[pciids_cur_vendor].string_offset, pciids_buf, sizeof(pciids_buf));
+
+    /* Don't let device lookups use an unrelated vendor entry. */
+    pciids_cur_vendor = -1;
 
 #ifdef PCI_LIB_VERSION
     /* Find vendor ID in the system pci.ids. */
-    pciids_cur_vendor = -1;
     pciids_lookup = pci_lookup_name(pacc, pciids_buf, sizeof(pciids_buf), PCI_LOOKUP_VENDOR | PCI_LOOKUP_NO_NUMBERS, vendor_id);
 #else
     pciids_lookup = NULL;
@@ -317,23 +958,54 @@ static char *
 pciids_get_device(uint16_t vendor_id, uint16_t device_id)
 {
     /* Must be preceded by a call to {find|get}_vendor to establish the vendor ID! */
+    uint32_t devices_offset, devices_end;
+    int      i, slot;
 
     /* Open database if required. */
     if ((pciids_cur_vendor < 0) || pciids_open_database((void **) &pciids_device, 'D'))
         goto no_device_db;
 
-    /* Go through device entries until the ID is matched or overtaken. */
-    for (pciids_cur_device = pciids_vendor[pciids_cur_vendor].devices_offset; pciids_device[pciids_cur_device].device_id < device_id; pciids_cur_device++)
-        ;
+    /* Stop if this vendor has no device entries. */
+    devices_offset = pciids_vendor[pciids_cur_vendor].devices_offset;
+    if (devices_offset == 0xffffffff)
+        goto no_device_db;
+
+    /* This vendor's device entries end where the next vendor's begin. Subvendor-only
+       entries in between have no device entries. The last vendor's end is unknown. */
+    devices_end = 0xffffffff;
+    if (pciids_vendor[pciids_cur_vendor].vendor_id != 0xffff) {
+        for (i = pciids_cur_vendor + 1; (pciids_vendor[i].devices_offset == 0xffffffff) && (pciids_vendor[i].vendor_id != 0xffff); i++)
+            ;
+        devices_end = pciids_vendor[i].devices_offset;
+    }
+
+    /* Use the hash table if present and this vendor is in it. Its slots only hold the low byte
+       of the entry index within the vendor's device entries, so check every entry it may be. */
+    slot = -1;
+    if ((devices_end != 0xffffffff) && ((devices_end - devices_offset) > PCIIDS_HASH_MIN_DEV))
+        slot = pciids_hash_lookup(&pciids_device_hash, 'I', ((uint32_t) vendor_id << 16) | device_id);
+    if (slot >= 0) {
+        for (pciids_cur_device = devices_offset + ((uint8_t *) &pciids_device_hash->data[pciids_device_hash->buckets])[slot];
+             ((uint32_t) pciids_cur_device < devices_end) && (pciids_device[pciids_cur_device].device_id != device_id); pciids_cur_device += 256)
+            ;
+        if ((uint32_t) pciids_cur_device >= devices_end)
+            goto no_device_db;
+    } else {
+        /* Go through device entries until the ID is matched or overtaken. */
+        for (pciids_cur_device = devices_offset; pciids_device[pciids_cur_device].device_id < device_id; pciids_cur_device++)
+            ;
+    }
 
     /* Return the device name if found. */
     if (pciids_device[pciids_cur_device].device_id == device_id)
-        return pciids_read_string(pciids_device[pciids_cur_device].string_offset);
+        return pciids_read_string(pciids_device[pciids_cur_device].string_offset, pciids_buf, sizeof(pciids_buf));
 
 no_device_db:
+    /* Don't let subdevice lookups use an unrelated device entry. */
+    pciids_cur_device = -1;
+
 #ifdef PCI_LIB_VERSION
     /* Find device ID in the system pci.ids. */
-    pciids_cur_device = -1;
     pciids_lookup = pci_lookup_name(pacc, pciids_buf, sizeof(pciids_buf), PCI_LOOKUP_DEVICE | PCI_LOOKUP_NO_NUMBERS, vendor_id, device_id);
 #else
     pciids_lookup = NULL;
@@ -359,7 +1031,7 @@ pciids_get_subdevice(uint16_t vendor_id, uint16_t device_id, uint16_t subvendor_
 
     /* Return the subdevice name if found. */
     if ((pciids_subdevice[i].subvendor_id == subvendor_id) && (pciids_subdevice[i].subdevice_id == subdevice_id))
-        return pciids_read_string(pciids_subdevice[i].string_offset);
+        return pciids_read_string(pciids_subdevice[i].string_offset, pciids_buf, sizeof(pciids_buf));
 
 no_subdevice_db:
 #ifdef PCI_LIB_VERSION
@@ -376,19 +1048,28 @@ no_subdevice_db:
 static char *
 pciids_get_class(uint8_t class_id)
 {
-    int i;
+    pciids_class_index_t *index;
+    int                   i;
 
     /* Open database if required. */
     if (pciids_open_database((void **) &pciids_class, 'C'))
         goto no_class_db;
 
+    /* Look up the class entry directly if the index is available. */
+    if ((index = pciids_open_class_index())) {
+        i = index->data[class_id];
+        if (i != 0xffff)
+            return pciids_read_string(pciids_class[i].string_offset, pciids_buf, sizeof(pciids_buf));
+        goto no_class_db;
+    }
+
     /* Go through class entries until the ID is matched or overtaken. */
     for (i = 0; pciids_class[i].class_id < class_id; i++)
         ;
 
     /* Return the class name if found. */
     if (pciids_class[i].class_id == class_id)
-        return pciids_read_string(pciids_class[i].string_offset);
+        return pciids_read_string(pciids_class[i].string_offset, pciids_buf, sizeof(pciids_buf));
 
 no_class_db:
 #ifdef PCI_LIB_VERSION
@@ -411,13 +1092,9 @@ pciids_get_subclass(uint8_t class_id, uint8_t subclass_id)
     if (pciids_open_database((void **) &pciids_subclass, 'U'))
         goto no_subclass_db;
 
-    /* Go through subclass entries until the ID is matched or overtaken. */
-    for (i = 0; (pciids_subclass[i].class_id < class_id) || (pciids_subclass[i].subclass_id < subclass_id); i++)
-        ;
-
     /* Return the subclass name if found. */
-    if ((pciids_subclass[i].class_id == class_id) && (pciids_subclass[i].subclass_id == subclass_id))
-        return pciids_read_string(pciids_subclass[i].string_offset);
+    if ((i = pciids_find_subclass(class_id, subclass_id)) >= 0)
+        return pciids_read_string(pciids_subclass[i].string_offset, pciids_buf, sizeof(pciids_buf));
 
 no_subclass_db:
 #ifdef PCI_LIB_VERSION
@@ -434,19 +1111,32 @@ no_subclass_db:
 static char *
 pciids_get_progif(uint8_t class_id, uint8_t subclass_id, uint8_t progif_id)
 {
-    int i;
+    pciids_class_index_t *index;
+    int                   i, end;
 
     /* Open database if required. */
     if (pciids_open_database((void **) &pciids_progif, 'P'))
         goto no_progif_db;
 
+    /* Go through the subclass' programming interface entries if the index is available. */
+    if ((index = pciids_open_class_index()) && !pciids_open_database((void **) &pciids_subclass, 'U')) {
+        if ((i = pciids_find_subclass(class_id, subclass_id)) < 0)
+            goto no_progif_db;
+        end = index->data[256 + 257 + i + 1];
+        for (i = index->data[256 + 257 + i]; i < end; i++) {
+            if ((pciids_progif[i].class_id == class_id) && (pciids_progif[i].subclass_id == subclass_id) && (pciids_progif[i].progif_id == progif_id))
+                return pciids_read_string(pciids_progif[i].string_offset, pciids_buf, sizeof(pciids_buf));
+        }
+        goto no_progif_db;
+    }
+
     /* Go through programming interface entries until the ID is matched or overtaken. */
     for (i = 0; (pciids_progif[i].class_id < class_id) || (pciids_progif[i].subclass_id < subclass_id) || (pciids_progif[i].progif_id < progif_id); i++)
         ;
 
     /* Return the programming interface name if found. */
     if ((pciids_progif[i].class_id == class_id) && (pciids_progif[i].subclass_id == subclass_id) && (pciids_progif[i].progif_id == progif_id))
-        return pciids_read_string(pciids_progif[i].string_offset);
+        return pciids_read_string(pciids_progif[i].string_offset, pciids_buf, sizeof(pciids_buf));
 
 no_progif_db:
 #ifdef PCI_LIB_VERSION
@@ -460,12 +1150,70 @@ no_progif_db:
     return pciids_lookup;
 }
 
+static void
+dump_print_dword(char sz, multi_t reg_val)
+{
+    /* Print the value as bytes/words/dword. */
+    switch (sz) {
+        case '.':
+            break;
+
+        case 'd':
+        case 'l':
+            printf(" %04X%04X", reg_val.u16[1], reg_val.u16[0]);
+            break;
+
+        case 'w':
+            printf(" %04X %04X", reg_val.u16[0], reg_val.u16[1]);
+            break;
+
+        default:
+            printf(" %02X %02X %02X %02X", reg_val.u8[0], reg_val.u8[1], reg_val.u8[2], reg_val.u8[3]);
+            break;
+    }
+}
+
+static int
+dump_ext_regs(uint8_t bus, uint8_t dev, uint8_t func, char sz, int width, uint8_t *regs)
+{
+    uint16_t cur_reg;
+    multi_t  reg_val;
+
+    /* Read the extended registers in one go, and stop if they can't be reached. */
+    if (!pci_read_regs(bus, dev, func, 0x100, 0x1000 - 0x100, regs)) {
+        if (sz != '.')
+            printf("\nExtended registers [100:FFF] are not accessible on this device or access method\n");
+        return 0;
+    }
+
+    /* Print them in the same layout as the standard registers. */
+    if (sz != '.') {
+        for (cur_reg = 0x100; cur_reg < 0x1000; cur_reg += 4) {
+            /* Print row header, with spacing at the halfway point. */
+            if (!(cur_reg & 0x0f))
+                printf("%03X:", cur_reg);
+            else if ((cur_reg & 0x0f) == 0x08)
+                putchar(' ');
+
+            reg_val.u32 = *((uint32_t *) &regs[cur_reg - 0x100]);
+            dump_print_dword(sz, reg_val);
+
+            /* Move on to the next line if the terminal didn't already do that for us.
+               Row headers are one digit wider than on the standard registers. */
+            if (((cur_reg & 0x0f) == 0x0c) && ((width + 1) < term_width))
+                putchar('\n');
+        }
+    }
+
+    return 1;
+}
+
 static int
-dump_regs(uint8_t bus, uint8_t dev, uint8_t func, uint8_t start_reg, char sz)
+dump_regs(uint8_t bus, uint8_t dev, uint8_t func, uint8_t start_reg, char sz, int extended)
 {
-    int     i, width, flags, bar_id;
+    int     i, width, flags, bar_id, ret = 0;
     char    buf[16];
-    uint8_t cur_reg, regs[256], dev_type, bar_reg;
+    uint8_t cur_reg, regs[256], dev_type, bar_reg, *ext_regs = NULL;
     multi_t reg_val;
     FILE   *f;
 
@@ -481,8 +1229,8 @@ dump_regs(uint8_t bus, uint8_t dev, uint8_t func, uint8_t start_reg, char sz)
     /* Size character '.' indicates a quiet dump for scan_bus. */
     if (sz != '.') {
         /* Print banner message. */
-        printf("Dumping registers [%02X:FF] from PCI bus %02X device %02X function %d\n\n", start_reg,
-               bus, dev, func);
+        printf("Dumping registers [%02X:%s] from PCI bus %02X device %02X function %d\n\n", start_reg,
+               extended ? "FFF" : "FF", bus, dev, func);
 
         /* Print column headers. */
         printf("   ");
@@ -525,6 +1273,12 @@ dump_regs(uint8_t bus, uint8_t dev, uint8_t func, uint8_t start_reg, char sz)
         printf("Dumping registers to %s", buf);
     }
 
+#ifndef DEBUG
+    /* Read the registers in one go, which is a single call with firmware access methods.
+       start_reg was dword-aligned above, as pci_read_regs requires. */
+    pci_read_regs(bus, dev, func, start_reg, 256 - start_reg, &regs[start_reg]);
+#endif
+
     cur_reg = 0;
     do {
         /* Print row header. */
@@ -561,31 +1315,15 @@ dump_regs(uint8_t bus, uint8_t dev, uint8_t func, uint8_t start_reg, char sz)
                         break;
                 }
             } else {
-                /* Yes, read dword value. */
+                /* Yes, get dword value. */
 #ifdef DEBUG
                 reg_val.u32 = pci_cf8(bus, dev, func, cur_reg);
 #else
-                reg_val.u32 = pci_readl(bus, dev, func, cur_reg);
+                reg_val.u32 = *((uint32_t *) &regs[cur_reg]);
 #endif
 
                 /* Print the value as bytes/words/dword. */
-                switch (sz) {
-                    case '.':
-                        break;
-
-                    case 'd':
-                    case 'l':
-                        printf(" %04X%04X", reg_val.u16[1], reg_val.u16[0]);
-                        break;
-
-                    case 'w':
-                        printf(" %04X %04X", reg_val.u16[0], reg_val.u16[1]);
-                        break;
-
-                    default:
-                        printf(" %02X %02X %02X %02X", reg_val.u8[0], reg_val.u8[1], reg_val.u8[2], reg_val.u8[3]);
-                        break;
-                }
+                dump_print_dword(sz, reg_val);
             }
 
             /* Save value to dump array. */
@@ -602,24 +1340,36 @@ dump_regs(uint8_t bus, uint8_t dev, uint8_t func, uint8_t start_reg, char sz)
         }
     } while (cur_reg);
 
+    /* Dump the PCI Express extended registers as well if requested. */
+    if (extended) {
+        ext_regs = arena_alloc(0x1000 - 0x100);
+        if (ext_regs && !dump_ext_regs(bus, dev, func, sz, width, ext_regs)) {
+            arena_free(ext_regs);
+            ext_regs = NULL;
+        }
+    }
+
     /* Print dump file name. */
     if (sz != '.')
         printf("\nSaving dump to %s\n", buf);
 
-    /* Write dump file. */
+    /* Write dump file, followed by the extended registers if they were read. */
     f = fopen(buf, "wb");
     if (!f) {
         if (sz != '.')
             printf("File creation failed\n");
+        arena_free(ext_regs);
         return 1;
     }
-    if (fwrite(regs, sizeof(regs), 1, f) < 1) {
-        fclose(f);
+    if ((fwrite(regs, sizeof(regs), 1, f) < 1) || (ext_regs && (fwrite(ext_regs, 0x1000 - 0x100, 1, f) < 1))) {
         if (sz != '.')
             printf("File write failed\n");
-        return 1;
+        ret = 1;
     }
     fclose(f);
+    arena_free(ext_regs);
+    if (ret)
+        return ret;
 
     if (sz == '.') {
         /* Clear the dump file name printed earlier. */
@@ -745,7 +1495,7 @@ unknown_device: /* Look up class ID. */
 
                 /* Dump registers if requested. */
                 if (dump)
-                    dump_regs(bus, dev, func, 0, '.');
+                    dump_regs(bus, dev, func, 0, '.', 0);
             } else {
                 /* Stop or move on to the next function if there's nothing here. */
                 if (func)
@@ -791,14 +1541,16 @@ next_func:
 static int
 scan_buses(char dump)
 {
-    int   i;
-    char *buf;
-    char *nesting_buf;
+    int      i;
+    uint8_t  bus;
+    uint16_t segment;
+    char    *buf;
+    char    *nesting_buf;
 
     /* Initialize buffers. */
-    buf = malloc(256);
+    buf = arena_alloc(256);
     buf[0] = '\0';
-    nesting_buf = malloc(256);
+    nesting_buf = arena_alloc(256);
     nesting_buf[0] = '\0';
 
     /* Get terminal size. */
@@ -809,12 +1561,18 @@ scan_buses(char dump)
     for (i = 0; i < term_width; i++)
         printf("─");
 
-    /* Scan the root bus. */
-    scan_bus(0, 0, nesting_buf, dump, buf);
+    /* Scan the root bus of every root bridge, marking where each PCI segment starts. */
+    for (i = 0; pci_get_root(i, &segment, &bus); i++) {
+        if (segment != pci_segment)
+            printf("Segment %04X\n", segment);
+        pci_segment = segment;
+        scan_bus(bus, 0, nesting_buf, dump, buf);
+    }
+    pci_segment = 0;
 
     /* Clean up. */
-    free(buf);
-    free(nesting_buf);
+    arena_free(nesting_buf);
+    arena_free(buf);
 
     return 0;
 }
@@ -1155,7 +1913,7 @@ retry_pir:
         /* Move data to a near buffer while converting to the PCI BIOS format. */
         i = (((uint16_t *) p)[3] - 32) >> 4; /* byte 6 */
         buf_size = sizeof(irq_routing_table_t) + (sizeof(irq_routing_entry_t) * (i - 1)); /* subtract the single entry in the base struct */
-        table = malloc(buf_size);
+        table = arena_alloc(buf_size);
         if (!table) {
             printf("Failed to allocate %d local bytes.\n", buf_size);
             goto retry_pir;
@@ -1226,7 +1984,7 @@ retry_pcibios:
         }
 
         /* Move data to a near buffer. */
-        table = malloc(buf_size);
+        table = arena_alloc(buf_size);
         if (!table) {
             printf("Failed to allocate %d local bytes.\n", buf_size);
             free_realmode(table_segment);
@@ -1245,7 +2003,7 @@ retry_pcibios:
         entries = table->len / sizeof(table->entry[0]);
         if (!entries) {
             printf("/* No entries found! */\n");
-            free(table);
+            arena_free(table);
             return 1;
         }
 
@@ -1421,7 +2179,7 @@ next_entry:
         entry++;
     }
 
-    free(table);
+    arena_free(table);
     return 0;
 }
 #endif
@@ -1542,12 +2300,13 @@ write_reg(uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg, char *val)
     return 0;
 }
 
-int
-main(int argc, char **argv)
+static int
+run(int argc, char **argv)
 {
-    int      hexargc, i;
+    int      hexargc, i, ret, has_segment = 0;
     char    *ch;
     uint8_t  hexargv[8], bus, dev, func, reg;
+    uint16_t segment;
     uint32_t cf8;
 
     /* Disable stdout buffering. */
@@ -1555,13 +2314,13 @@ main(int argc, char **argv)
 
     /* Print usage if there are too few parameters or if the first one looks invalid. */
     if ((argc <= 1) || (strlen(argv[1]) < 2) || ((argv[1][0] != '-') && (argv[1][0] != '/'))) {
+usage:
         ch = strrchr(argv[0], '\\');
         if (!(ch++)) {
             ch = strrchr(argv[0], '/');
             if (!(ch++))
                 ch = argv[0];
         }
-usage:
         printf("%s -s [-d]\n", ch);
         printf("∟ Display all devices on the PCI bus. Specify -d to dump registers as well.\n");
 #if defined(__DOS__) || defined(__PMODEW__)
@@ -1571,21 +2330,23 @@ usage:
         printf("  table instead of calling PCI BIOS. Specify -8 to display as 86Box code.\n");
 #endif
         printf("\n");
-        printf("%s -i [bus] device [function]\n", ch);
+        printf("%s -i [[segment:]bus] device [function]\n", ch);
         printf("∟ Show information about the specified device.\n");
         printf("\n");
-        printf("%s -r [bus] device [function] register\n", ch);
+        printf("%s -r [[segment:]bus] device [function] register\n", ch);
         printf("∟ Read the specified register.\n");
         printf("\n");
-        printf("%s -w [bus] device [function] register value\n", ch);
+        printf("%s -w [[segment:]bus] device [function] register value\n", ch);
         printf("∟ Write byte, word or dword to the specified register.\n");
         printf("\n");
-        printf("%s {-d|-dw|-dl} [bus] device [function [register]]\n", ch);
+        printf("%s {-d|-dw|-dl}[x] [[segment:]bus] device [function [register]]\n", ch);
         printf("∟ Dump registers as bytes (-d), words (-dw) or dwords (-dl). Optionally\n");
         printf("  specify the register to start from (requires bus to be specified as well).\n");
+        printf("  Append x to dump the PCI Express extended registers [100:FFF] as well.\n");
         printf("\n");
         printf("All numeric parameters should be specified in hexadecimal (without 0x prefix).\n");
         printf("{bus device function register} can be substituted for a single port CF8h dword.\n");
+        printf("A segment other than 0 requires bus to be specified, and is only found on UEFI.\n");
         printf("Register dumps are saved to PCIbbddf.BIN where bb=bus, dd=device, f=function.");
         term_final_linebreak();
         return 1;
@@ -1609,11 +2370,22 @@ usage:
 
     /* Interpret parameters. */
     if (argv[1][1] == 's') {
+#ifdef PCIIDS_PRELOAD
+        /* Decode the PCI ID database in the background while the bus is scanned. */
+        pciids_preload();
+#endif
+
         /* Bus scan only asks for a single optional parameter. */
         if ((argc >= 3) && (strlen(argv[2]) > 1))
-            return scan_buses(argv[2][1]);
+            ret = scan_buses(argv[2][1]);
         else
-            return scan_buses('\0');
+            ret = scan_buses('\0');
+
+#ifdef PCIIDS_PRELOAD
+        /* Don't leave decoding threads behind. */
+        pciids_preload_join();
+#endif
+        return ret;
     }
 #if defined(__DOS__) || defined(__PMODEW__)
     else if (argv[1][1] == 't') {
@@ -1631,6 +2403,24 @@ usage:
     }
 #endif
     else if ((argc >= 3) && (strlen(argv[1]) > 1)) {
+        /* Split a segment off the second parameter if it was specified as segment:bus. */
+        ch = strchr(argv[2], ':');
+        if (ch) {
+            *ch++ = '\0';
+            if (!argv[2][0] || !*ch || !parse_hex_u16(argv[2], &pci_segment))
+                goto usage;
+            argv[2]     = ch;
+            has_segment = 1;
+
+            /* Make sure a root bridge is on that segment. */
+            for (i = 0; pci_get_root(i, &segment, &bus) && (segment != pci_segment); i++)
+                ;
+            if (segment != pci_segment) {
+                printf("PCI segment %04X not found\n", pci_segment);
+                return 1;
+            }
+        }
+
         /* Read second parameter as a dword. */
         if (parse_hex_u32(argv[2], &cf8)) {
             /* Initialize default bus/device/function/register values. */
@@ -1657,7 +2447,9 @@ usage:
         }
 
         if ((argv[1][1] == 'd') || (argv[1][1] == 'i')) {
-            /* Process parameters for a register or information dump. */
+            /* Process parameters for a register or information dump. A segment only goes with a bus. */
+            if (has_segment && (hexargc < 3))
+                goto usage;
             switch (hexargc) {
                 case 4:
                     /* Specifying a register is not valid on an information dump. */
@@ -1690,8 +2482,8 @@ usage:
             /* Start the operation. */
             switch (argv[1][1]) {
                 case 'd':
-                    /* Start register dump. */
-                    return dump_regs(bus, dev, func, reg, argv[1][2]);
+                    /* Start register dump, with extended registers if x was appended. */
+                    return dump_regs(bus, dev, func, reg, argv[1][2], strchr(&argv[1][2], 'x') != NULL);
 
                 case 'i':
                     /* Start information dump. */
@@ -1702,7 +2494,9 @@ usage:
             if (argv[1][1] == 'w')
                 hexargc -= 1;
 
-            /* Process parameters for read/write operations. */
+            /* Process parameters for read/write operations. A segment only goes with a bus. */
+            if (has_segment && (hexargc < 4))
+                goto usage;
             switch (hexargc) {
                 case 4:
                     reg  = hexargv[3];
@@ -1753,3 +2547,13 @@ usage:
 
     return 1;
 }
+
+int
+main(int argc, char **argv)
+{
+    int ret = run(argc, argv);
+
+    /* Give back everything allocated for the whole run. */
+    arena_reset();
+    return ret;
+}
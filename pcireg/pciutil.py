@@ -15,7 +15,11 @@
 #
 #                Copyright 2021 RichardG.
 #
-import io, re, urllib.request
+import hashlib, io, multiprocessing, os, pickle, re, sys, time, urllib.request
+try:
+	import re._parser as sre_parse
+except ImportError:
+	import sre_parse
 
 clean_device_abbr = [
 	# Generic patterns to catch extended abbreviations: "Abbreviated Terms (AT)"
@@ -93,29 +97,60 @@ clean_vendor_final = {
 	'VMWare': 'VMware',
 }
 
+# Characters which match an ASCII letter case-insensitively without lowercasing to it.
+clean_device_fold = str.maketrans({'\u0130': 'i', '\u0131': 'i', '\u017f': 's', '\u212a': 'k'})
+
 _clean_device_abbr_cache = []
+_clean_device_prefilter = True
 _pci_vendors = {}
+_pci_vendor_digests = {}
 _pci_devices = {}
 _pci_subdevices = {}
 _pci_classes = {}
 _pci_subclasses = {}
 _pci_progifs = {}
 
+def _pattern_keyword(pattern):
+	"""Get the longest literal string which must be present for a pattern to match."""
+
+	# Go through the top level of the parsed pattern, looking for runs of literals.
+	keyword = current = ''
+	for op, arg in sre_parse.parse(pattern, re.I):
+		if op == sre_parse.LITERAL and arg < 0x80:
+			current += chr(arg)
+			if len(current) > len(keyword):
+				keyword = current
+		else:
+			current = ''
+
+	return keyword.lower() or None
+
 def clean_device(device, vendor=None):
 	"""Make a device name more compact if possible."""
 
 	# Generate pattern cache if required.
 	if not _clean_device_abbr_cache:
 		for pattern, replace in clean_device_abbr:
+			pattern = '''(?P<prefix> |^|\(|\[|\{|/)''' + pattern + '''(?P<suffix> |$|\)|\]|\})'''
 			_clean_device_abbr_cache.append((
-				re.compile('''(?P<prefix> |^|\(|\[|\{|/)''' + pattern + '''(?P<suffix> |$|\)|\]|\})''', re.I),
+				_pattern_keyword(pattern),
+				re.compile(pattern, re.I),
 				'\\g<prefix>' + replace + '\\g<suffix>',
 			))
 
-	# Apply patterns.
+	# Apply patterns, skipping the ones whose keyword is not present in the name.
 	device = clean_device_bit_pattern.sub('\\1\\2\\3\\4\\5bit\\6', device)
-	for pattern, replace in _clean_device_abbr_cache:
-		device = pattern.sub(replace, device)
+	folded = None
+	for keyword, pattern, replace in _clean_device_abbr_cache:
+		if keyword and _clean_device_prefilter:
+			if folded == None:
+				folded = device.translate(clean_device_fold).lower()
+			if keyword not in folded:
+				continue
+		new_device = pattern.sub(replace, device)
+		if new_device != device:
+			device = new_device
+			folded = None
 	device = clean_device_suffix_pattern.sub('\\1', device)
 
 	# Remove duplicate vendor ID.
@@ -125,6 +160,77 @@ def clean_device(device, vendor=None):
 	# Remove duplicate spaces.
 	return ' '.join(device.split())
 
+def clean_devices(devices):
+	"""Make a list of device names more compact, spreading the work over
+	   all CPUs. Returns a dictionary of original names to compact names."""
+
+	# Clean each distinct name only once.
+	devices = list(dict.fromkeys(devices))
+
+	# Use a process pool if there are multiple CPUs to spread the work over.
+	cpu_count = os.cpu_count() or 1
+	if cpu_count > 1 and len(devices) >= 1000:
+		with multiprocessing.Pool(cpu_count) as pool:
+			cleaned_devices = pool.map(clean_device, devices, chunksize=256)
+	else:
+		cleaned_devices = [clean_device(device) for device in devices]
+
+	return dict(zip(devices, cleaned_devices))
+
+def clean_pci_db_devices(cache_file=None):
+	"""Make all device and subdevice names in the loaded PCI ID database more
+	   compact, reusing the names cached in cache_file for vendors whose block
+	   in pci.ids has not changed. Returns a dictionary of original names to
+	   compact names."""
+
+	# Load cache, discarding it if the cleaning rules have changed since.
+	rules_digest = hashlib.sha1(repr((clean_device_abbr, clean_device_bit_pattern.pattern, clean_device_suffix_pattern.pattern)).encode('utf8', 'ignore')).digest()
+	cache = {}
+	if cache_file:
+		try:
+			with open(cache_file, 'rb') as f:
+				cache_rules_digest, cache = pickle.load(f)
+			if cache_rules_digest != rules_digest:
+				cache = {}
+		except:
+			cache = {}
+
+	# Group device and subdevice names by vendor.
+	vendor_devices = {}
+	for pci_id, device in _pci_devices.items():
+		devices = vendor_devices.setdefault(pci_id >> 16, [])
+		devices.append(device)
+		devices += _pci_subdevices.get(pci_id, {}).values()
+
+	# Reuse cached names for unchanged vendors.
+	clean_names = {}
+	new_cache = {}
+	uncached_vendors = []
+	for vendor_id, devices in vendor_devices.items():
+		digest = _pci_vendor_digests.get(vendor_id, None)
+		if digest in cache:
+			new_cache[digest] = cache[digest]
+			clean_names.update(cache[digest])
+		else:
+			uncached_vendors.append((digest, devices))
+
+	# Clean names for new and changed vendors.
+	cleaned_devices = clean_devices(device for digest, devices in uncached_vendors for device in devices)
+	clean_names.update(cleaned_devices)
+	for digest, devices in uncached_vendors:
+		if digest:
+			new_cache[digest] = {device: cleaned_devices[device] for device in devices}
+
+	# Save cache.
+	if cache_file:
+		try:
+			with open(cache_file, 'wb') as f:
+				pickle.dump((rules_digest, new_cache), f)
+		except:
+			pass
+
+	return clean_names
+
 def clean_vendor(vendor):
 	"""Make a vendor name more compact if possible."""
 
@@ -215,12 +321,14 @@ def load_pci_db():
 			return
 
 	vendor = 0
+	vendor_digest = None
 	class_num = subclass_num = None
 	for line in f:
 		if len(line) < 2 or line[0] == 35:
 			continue
 		elif line[0] == 67: # class
 			class_num = int(line[2:4], 16)
+			vendor_digest = None
 			_pci_classes[class_num] = line[6:-1].decode('utf8', 'ignore')
 		elif class_num != None: # subclass/progif
 			if line[1] != 9: # subclass
@@ -232,6 +340,8 @@ def load_pci_db():
 		elif line[0] != 9: # vendor
 			vendor = int(line[:4], 16)
 			_pci_vendors[vendor] = line[6:-1].decode('utf8', 'ignore')
+			vendor_digest = _pci_vendor_digests[vendor] = hashlib.sha1(line)
+			continue
 		elif line[1] != 9: # device
 			device = (vendor << 16) | int(line[1:5], 16)
 			_pci_devices[device] = line[7:-1].decode('utf8', 'ignore')
@@ -241,10 +351,55 @@ def load_pci_db():
 				_pci_subdevices[device] = {}
 			_pci_subdevices[device][subdevice] = line[13:-1].decode('utf8', 'ignore')
 
+		# Hash the vendor's block, for clean_pci_db_devices to detect changes with.
+		if vendor_digest:
+			vendor_digest.update(line)
+
 	f.close()
 
+	# Finalize vendor block hashes.
+	for vendor in _pci_vendor_digests:
+		_pci_vendor_digests[vendor] = _pci_vendor_digests[vendor].digest()
+
+def _benchmark():
+	"""Compare the cleaning of all device names with and without the keyword
+	   prefilter and process pool, checking that the results match."""
+	global _clean_device_prefilter
+
+	# Load PCI ID database.
+	load_pci_db()
+	devices = list(_pci_devices.values())
+	for subdevices in _pci_subdevices.values():
+		devices += subdevices.values()
+	print(len(devices), 'device names')
+
+	# Clean all names the slow way first.
+	_clean_device_prefilter = False
+	start = time.perf_counter()
+	golden = [clean_device(device) for device in devices]
+	print('Reference: {0:.2f}s'.format(time.perf_counter() - start))
+
+	# Then with the prefilter.
+	_clean_device_prefilter = True
+	start = time.perf_counter()
+	result = [clean_device(device) for device in devices]
+	print('Prefilter: {0:.2f}s'.format(time.perf_counter() - start))
+	mismatches = sum(a != b for a, b in zip(golden, result))
+
+	# Then with the prefilter and process pool.
+	start = time.perf_counter()
+	cleaned_devices = clean_devices(devices)
+	print('Prefilter and {0} processes: {1:.2f}s'.format(os.cpu_count() or 1, time.perf_counter() - start))
+	mismatches += sum(a != cleaned_devices[b] for a, b in zip(golden, devices))
+
+	# Report any mismatches.
+	print(mismatches and '{0} mismatches!'.format(mismatches) or 'All names match')
+	return mismatches and 1 or 0
+
 # Debugging feature.
 if __name__ == '__main__':
+	if '-b' in sys.argv[1:]:
+		sys.exit(_benchmark())
 	s = input()
 	try:
 		if len(s) in (8, 9):
@@ -0,0 +1,369 @@
+/*
+ * 86Box	A hypervisor and IBM PC system emulator that specializes in
+ *		running old operating systems and software designed for IBM
+ *		PC systems and compatibles from 1981 through fairly recent
+ *		system designs based on the PCI bus.
+ *
+ *		This file is part of the 86Box Probing Tools distribution.
+ *
+ *		Host tool for checking and benchmarking the memory and
+ *		string functions of the UEFI C library.
+ *
+ */
+#define _GNU_SOURCE /* for memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* uefi/string.c is built with its functions renamed to these. */
+extern void  *uefi_memcpy(void *dst, const void *src, size_t n);
+extern void  *uefi_memmove(void *dst, const void *src, size_t n);
+extern void  *uefi_memset(void *s, int c, size_t n);
+extern int    uefi_memcmp(const void *s1, const void *s2, size_t n);
+extern void  *uefi_memchr(const void *s, int c, size_t n);
+extern void  *uefi_memmem(const void *haystack, size_t hl, const void *needle, size_t nl);
+extern size_t uefi_strlen(const char *s);
+extern char  *uefi_strstr(const char *haystack, const char *needle);
+
+/* The byte loops these functions used to be, as the baseline for benchmarks. */
+#if defined(__GNUC__) && !defined(__clang__)
+#    define BYTE_LOOP __attribute__((noinline, optimize("no-tree-vectorize", "no-tree-loop-distribute-patterns")))
+#else
+#    define BYTE_LOOP __attribute__((noinline))
+#endif
+
+static BYTE_LOOP void *
+byte_memcpy(void *dst, const void *src, size_t n)
+{
+    unsigned char       *a = dst;
+    const unsigned char *b = src;
+
+    while (n--)
+        *a++ = *b++;
+    return dst;
+}
+
+static BYTE_LOOP void *
+byte_memset(void *s, int c, size_t n)
+{
+    unsigned char *p = s;
+
+    while (n--)
+        *p++ = c;
+    return s;
+}
+
+static BYTE_LOOP int
+byte_memcmp(const void *s1, const void *s2, size_t n)
+{
+    const unsigned char *a = s1, *b = s2;
+
+    while (n--) {
+        if (*a != *b)
+            return *a - *b;
+        a++;
+        b++;
+    }
+    return 0;
+}
+
+static BYTE_LOOP void *
+byte_memchr(const void *s, int c, size_t n)
+{
+    const unsigned char *p = s, *e = p + n;
+
+    for (; p < e; p++) {
+        if (*p == (unsigned char) c)
+            return (void *) p;
+    }
+    return NULL;
+}
+
+static BYTE_LOOP void *
+byte_memmem(const void *haystack, size_t hl, const void *needle, size_t nl)
+{
+    const unsigned char *c = haystack;
+
+    if (!hl || !nl || (nl > hl))
+        return NULL;
+    for (hl -= nl - 1; hl; hl--, c++) {
+        if (!byte_memcmp(c, needle, nl))
+            return (void *) c;
+    }
+    return NULL;
+}
+
+static BYTE_LOOP size_t
+byte_strlen(const char *s)
+{
+    size_t ret;
+
+    for (ret = 0; s[ret]; ret++)
+        ;
+    return ret;
+}
+
+static unsigned int rng = 1;
+
+static unsigned int
+rand32(void)
+{
+    /* xorshift32, so that checks and benchmarks are the same on every host. */
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static int
+sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+static unsigned char *
+guarded_alloc(size_t size)
+{
+    long           page = sysconf(_SC_PAGESIZE);
+    size_t         len  = ((size + page - 1) / page) * page;
+    unsigned char *p;
+
+    /* Place the buffer right before an inaccessible page, so that reading past its end faults. */
+    p = mmap(NULL, len + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    mprotect(p + len, page, PROT_NONE);
+    return p + len - size;
+}
+
+#define CHECK_SIZE 4096
+#define GUARD      0xa5
+
+#define FAIL(...)                     \
+    do {                              \
+        printf("FAIL: " __VA_ARGS__); \
+        errors++;                     \
+    } while (0)
+
+static int
+check(void)
+{
+    unsigned char *src, *dst, *ref, *end;
+    char          *str;
+    size_t         n, i, j, k, lengths[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 255, 256, 511, 512, 513, 1000, 2048, 4000 };
+    int            errors = 0;
+
+    src = malloc(CHECK_SIZE + 64);
+    dst = malloc(CHECK_SIZE + 64);
+    ref = malloc(CHECK_SIZE + 64);
+    end = guarded_alloc(CHECK_SIZE);
+    if (!src || !dst || !ref || !end) {
+        printf("Could not allocate buffers\n");
+        return 1;
+    }
+    for (i = 0; i < CHECK_SIZE + 64; i++)
+        src[i] = rand32();
+
+    /* Every length over every source and destination alignment, with guard bytes around the destination. */
+    for (k = 0; k < (sizeof(lengths) / sizeof(lengths[0])); k++) {
+        n = lengths[k];
+        for (i = 0; i < 16; i++) {
+            for (j = 0; j < 16; j++) {
+                memset(dst, GUARD, CHECK_SIZE + 64);
+                memset(ref, GUARD, CHECK_SIZE + 64);
+                uefi_memcpy(dst + 8 + j, src + i, n);
+                memcpy(ref + 8 + j, src + i, n);
+                if (memcmp(dst, ref, CHECK_SIZE + 64))
+                    FAIL("memcpy length %zu alignment %zu/%zu\n", n, i, j);
+
+                uefi_memset(dst + 8 + j, i, n);
+                memset(ref + 8 + j, i, n);
+                if (memcmp(dst, ref, CHECK_SIZE + 64))
+                    FAIL("memset length %zu alignment %zu\n", n, j);
+
+                /* Equal, then differing at the first, middle and last byte. */
+                memcpy(dst + j, src + i, n);
+                if (uefi_memcmp(dst + j, src + i, n))
+                    FAIL("memcmp length %zu alignment %zu/%zu equal\n", n, i, j);
+                if (n) {
+                    size_t at[3] = { 0, n / 2, n - 1 };
+                    int    a;
+                    for (a = 0; a < 3; a++) {
+                        memcpy(dst + j, src + i, n);
+                        dst[j + at[a]] ^= 0x80 >> (a + i);
+                        if (sign(uefi_memcmp(dst + j, src + i, n)) != sign(memcmp(dst + j, src + i, n)))
+                            FAIL("memcmp length %zu alignment %zu/%zu differing at %zu\n", n, i, j, at[a]);
+                    }
+                }
+
+                /* Overlapping moves in both directions. */
+                memcpy(dst, src, CHECK_SIZE + 64);
+                memcpy(ref, src, CHECK_SIZE + 64);
+                uefi_memmove(dst + j, dst + i, n);
+                memmove(ref + j, ref + i, n);
+                if (memcmp(dst, ref, CHECK_SIZE + 64))
+                    FAIL("memmove length %zu from %zu to %zu\n", n, i, j);
+            }
+        }
+    }
+
+    /* Searches ending right at an inaccessible page, with the match at every position. */
+    for (n = 0; n <= 100; n++) {
+        for (i = 0; i < n; i++) {
+            memset(end + CHECK_SIZE - n, 'a', n);
+            end[CHECK_SIZE - n + i] = 'b';
+            if (uefi_memchr(end + CHECK_SIZE - n, 'b', n) != end + CHECK_SIZE - n + i)
+                FAIL("memchr length %zu match at %zu\n", n, i);
+            end[CHECK_SIZE - n + i] = 'a';
+            if (uefi_memchr(end + CHECK_SIZE - n, 'b', n))
+                FAIL("memchr length %zu found a missing byte\n", n);
+        }
+
+        str = (char *) end + CHECK_SIZE - n - 1;
+        memset(str, 'x', n);
+        str[n] = '\0';
+        if (uefi_strlen(str) != n)
+            FAIL("strlen length %zu\n", n);
+    }
+
+    /* Substring searches against libc, on text with many partial matches. */
+    for (k = 0; k < 2000; k++) {
+        n = 1 + (rand32() % 300);
+        for (i = 0; i < n; i++)
+            dst[i] = 'a' + (rand32() % 3);
+        j = 1 + (rand32() % 8);
+        for (i = 0; i < j; i++)
+            ref[i] = 'a' + (rand32() % 3);
+        if (uefi_memmem(dst, n, ref, j) != memmem(dst, n, ref, j))
+            FAIL("memmem length %zu needle %zu\n", n, j);
+        dst[n] = ref[j] = '\0';
+        if (uefi_strstr((char *) dst, (char *) ref) != strstr((char *) dst, (char *) ref))
+            FAIL("strstr length %zu needle %zu\n", n, j);
+    }
+
+    free(src);
+    free(dst);
+    free(ref);
+    if (errors)
+        printf("%d checks failed\n", errors);
+    else
+        printf("All checks passed\n");
+    return !!errors;
+}
+
+#define BENCH_MAX (1 << 20)
+
+static volatile size_t sink;
+
+static double
+bench_one(int func, int impl, unsigned char *a, unsigned char *b, size_t n, int reps)
+{
+    double t, best = 1e9;
+    size_t iters, it;
+    int    r;
+
+    /* Repeat small sizes, so that each run moves about as much data as the largest size. */
+    iters = BENCH_MAX / n;
+    for (r = 0; r < reps; r++) {
+        t = now();
+        for (it = 0; it < iters; it++) {
+            switch (func) {
+                case 0:
+                    sink += (size_t) (impl ? uefi_memcpy(a, b + 1, n) : byte_memcpy(a, b + 1, n));
+                    break;
+                case 1:
+                    sink += (size_t) (impl ? uefi_memset(a, 0x55, n) : byte_memset(a, 0x55, n));
+                    break;
+                case 2:
+                    sink += impl ? uefi_memcmp(a, b, n) : byte_memcmp(a, b, n);
+                    break;
+                case 3:
+                    sink += impl ? uefi_strlen((char *) b) : byte_strlen((char *) b);
+                    break;
+                case 4:
+                    sink += (size_t) (impl ? uefi_memchr(b, 'z', n) : byte_memchr(b, 'z', n));
+                    break;
+                default:
+                    sink += (size_t) (impl ? uefi_memmem(b, n, "zz", 2) : byte_memmem(b, n, "zz", 2));
+                    break;
+            }
+        }
+        t = now() - t;
+        if (t < best)
+            best = t;
+    }
+    return (double) iters * n / best / 1e6;
+}
+
+static int
+benchmark(int reps)
+{
+    static const char *names[] = { "memcpy", "memset", "memcmp", "strlen", "memchr", "memmem" };
+    size_t             sizes[] = { 16, 64, 256, 4096, 65536, BENCH_MAX };
+    unsigned char     *a, *b;
+    double             old_rate, new_rate;
+    int                func, s;
+
+    a = malloc(BENCH_MAX + 16);
+    b = malloc(BENCH_MAX + 16);
+    if (!a || !b) {
+        printf("Could not allocate buffers\n");
+        return 1;
+    }
+
+    printf("%-8s %9s %11s %11s %8s\n", "Function", "Size", "Bytes MB/s", "Words MB/s", "Speedup");
+    for (func = 0; func < 6; func++) {
+        for (s = 0; s < (int) (sizeof(sizes) / sizeof(sizes[0])); s++) {
+            /* Fill both buffers with the same text, without the searched byte, terminated at the size. */
+            memset(a, 'x', BENCH_MAX + 16);
+            memset(b, 'x', BENCH_MAX + 16);
+            b[sizes[s]] = '\0';
+
+            old_rate = bench_one(func, 0, a, b, sizes[s], reps);
+            new_rate = bench_one(func, 1, a, b, sizes[s], reps);
+            printf("%-8s %9zu %11.0f %11.0f %7.1fx\n", names[func], sizes[s], old_rate, new_rate, new_rate / old_rate);
+        }
+    }
+
+    free(a);
+    free(b);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int i, reps = 5, bench = 1;
+
+    /* Parse flags. */
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+        if (!strcmp(argv[i], "-n") && ((i + 1) < argc)) {
+            reps = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-c")) {
+            bench = 0;
+        } else {
+            printf("%s [-c] [-n reps]\n", argv[0]);
+            printf("- Checks the UEFI C library's memory and string functions against the host's,\n");
+            printf("  then benchmarks them against plain byte loops.\n");
+            printf("  Specify -c to only run the checks, or -n to set the number of timed runs\n");
+            printf("  per benchmark, of which the fastest is reported (default 5).\n");
+            return 1;
+        }
+    }
+
+    if (check())
+        return 1;
+    return bench ? benchmark(reps) : 0;
+}
@@ -32,6 +32,7 @@
 
 /* this is implemented by the application */
 extern int main(int argc, char_t **argv);
+extern void __stdio_cleanup(void);
 
 /* definitions for elf relocations */
 #ifndef __clang__
@@ -233,9 +234,10 @@ efi_status_t uefi_init (
         }
     }
     ret = main(argc, (char**)__argvutf8);
-    if(__argvutf8) BS->FreePool(__argvutf8);
+    __stdio_cleanup();
 #else
     ret = main(argc, argv);
+    __stdio_cleanup();
 #endif
     return ret ? EFIERR(ret) : EFI_SUCCESS;
 }
@@ -39,11 +39,189 @@ void __stdio_cleanup(void);
 void __stdio_seterrno(efi_status_t status);
 int __remove (const char_t *__filename, int isdir);
 
+/* user space buffers for files, so that small reads and writes don't each cost a firmware call.
+ * When the buffer holds read data, the firmware's position is at off + len, and when it holds
+ * data still to be written, it is at off. Either way, the stream's position is off + pos */
+typedef struct {
+    FILE *f;
+    uint8_t *buf;
+    uintn_t size, pos, len;
+    uint64_t off;
+    int dirty, own;
+} __stdio_buf_t;
+static __stdio_buf_t __stdio_bufs[FOPEN_MAX];
+
+static __stdio_buf_t *__stdio_getbuf(FILE *__stream)
+{
+    uintn_t i;
+    if(!__stream) return NULL;
+    for(i = 0; i < FOPEN_MAX; i++)
+        if(__stdio_bufs[i].f == __stream)
+            return &__stdio_bufs[i];
+    return NULL;
+}
+
+/* allocate the buffer on first use, so that setvbuf can still change it */
+static int __stdio_allocbuf(__stdio_buf_t *b)
+{
+    if(b->buf) return 1;
+    b->buf = (uint8_t*)malloc(b->size);
+    b->own = 1;
+    return b->buf != NULL;
+}
+
+/* write out pending data */
+static int __stdio_flushbuf(__stdio_buf_t *b)
+{
+    efi_status_t status;
+    uintn_t bs = b->len;
+    if(!b->dirty) return 1;
+    b->dirty = 0;
+    status = b->f->Write(b->f, &bs, b->buf);
+    b->off += b->len;
+    b->pos = b->len = 0;
+    if(EFI_ERROR(status)) { __stdio_seterrno(status); return 0; }
+    return 1;
+}
+
+/* drop read data, moving the firmware's position back to the stream's */
+static int __stdio_dropbuf(__stdio_buf_t *b)
+{
+    efi_status_t status = EFI_SUCCESS;
+    if(b->dirty) return __stdio_flushbuf(b);
+    if(b->pos != b->len) status = b->f->SetPosition(b->f, b->off + b->pos);
+    b->off += b->pos;
+    b->pos = b->len = 0;
+    if(EFI_ERROR(status)) { __stdio_seterrno(status); return 0; }
+    return 1;
+}
+
+static void __stdio_freebuf(__stdio_buf_t *b)
+{
+    if(b->own && b->buf) free(b->buf);
+    memset(b, 0, sizeof(__stdio_buf_t));
+}
+
+static uintn_t __stdio_readbuf(__stdio_buf_t *b, uint8_t *ptr, uintn_t n)
+{
+    efi_status_t status;
+    uintn_t done = 0, bs;
+    if(b->dirty && !__stdio_flushbuf(b)) return 0;
+    while(done < n) {
+        /* take what is buffered */
+        if(b->pos < b->len) {
+            bs = b->len - b->pos < n - done ? b->len - b->pos : n - done;
+            memcpy(ptr + done, b->buf + b->pos, bs);
+            b->pos += bs; done += bs;
+            continue;
+        }
+        b->off += b->len;
+        b->pos = b->len = 0;
+        /* large reads go straight to the caller's memory, small ones refill the buffer */
+        if(n - done >= b->size || !__stdio_allocbuf(b)) {
+            bs = n - done;
+            status = b->f->Read(b->f, &bs, ptr + done);
+            if(EFI_ERROR(status)) { __stdio_seterrno(status); break; }
+            b->off += bs; done += bs;
+            break;
+        }
+        bs = b->size;
+        status = b->f->Read(b->f, &bs, b->buf);
+        if(EFI_ERROR(status)) { __stdio_seterrno(status); break; }
+        if(!bs) break;
+        b->len = bs;
+    }
+    return done;
+}
+
+static uintn_t __stdio_writebuf(__stdio_buf_t *b, const uint8_t *ptr, uintn_t n)
+{
+    efi_status_t status;
+    uintn_t bs;
+    if(!b->dirty && !__stdio_dropbuf(b)) return 0;
+    /* data which doesn't fit goes straight to the file, after anything pending */
+    if(b->len + n > b->size || !__stdio_allocbuf(b)) {
+        if(!__stdio_flushbuf(b)) return 0;
+        if(n >= b->size || !__stdio_allocbuf(b)) {
+            bs = n;
+            status = b->f->Write(b->f, &bs, (void*)ptr);
+            if(EFI_ERROR(status)) { __stdio_seterrno(status); return 0; }
+            b->off += bs;
+            return bs;
+        }
+    }
+    memcpy(b->buf + b->len, ptr, n);
+    b->len += n;
+    b->pos = b->len;
+    b->dirty = 1;
+    return n;
+}
+
+int setvbuf (FILE *__stream, char *__buf, int __modes, size_t __n)
+{
+    __stdio_buf_t *b = __stdio_getbuf(__stream);
+    if(!b || (__modes != _IOFBF && __modes != _IOLBF && __modes != _IONBF)) { errno = EINVAL; return -1; }
+    if(!__stdio_dropbuf(b)) return -1;
+    if(b->own && b->buf) free(b->buf);
+    if(__modes == _IONBF) { __stdio_freebuf(b); return 0; }
+    b->buf = (uint8_t*)__buf;
+    b->own = 0;
+    b->size = __n ? __n : BUFSIZ;
+    return 0;
+}
+
+void setbuf (FILE *__stream, char *__buf)
+{
+    setvbuf(__stream, __buf, __buf ? _IOFBF : _IONBF, BUFSIZ);
+}
+
+/* console output is collected here and passed to OutputString a line at a time, because every
+ * call to the firmware's console is slow, especially when it is redirected to a serial port */
+#define __STDIO_CONBUF 512
+static wchar_t __stdio_conbuf[__STDIO_CONBUF];
+static uintn_t __stdio_conlen = 0;
+static wchar_t __stdio_conlast = 0;
+
+static void __stdio_conflush(void)
+{
+    if(!__stdio_conlen) return;
+    __stdio_conbuf[__stdio_conlen] = 0;
+    __stdio_conlen = 0;
+    ST->ConOut->OutputString(ST->ConOut, __stdio_conbuf);
+}
+
+/* append a string, turning \n into \r\n, and flush if it ended a line */
+static void __stdio_conwrite(const wchar_t *__s)
+{
+    int nl = 0;
+    for(; *__s; __s++) {
+        if(__stdio_conlen >= __STDIO_CONBUF - 3) __stdio_conflush();
+        if(*__s == L'\n') {
+            if(__stdio_conlast != L'\r') __stdio_conbuf[__stdio_conlen++] = L'\r';
+            nl = 1;
+        }
+        __stdio_conbuf[__stdio_conlen++] = __stdio_conlast = *__s;
+    }
+    if(nl) __stdio_conflush();
+}
+
 void __stdio_cleanup(void)
 {
+    uintn_t i;
+    FILE *f;
+    __stdio_conflush();
+    /* flush and close the files left open, as their buffered data would be lost otherwise */
+    for(i = 0; i < FOPEN_MAX; i++)
+        if((f = __stdio_bufs[i].f)) {
+            __stdio_flushbuf(&__stdio_bufs[i]);
+            __stdio_freebuf(&__stdio_bufs[i]);
+            f->Close(f);
+        }
 #ifndef UEFI_NO_UTF8
-    if(__argvutf8)
+    if(__argvutf8) {
         BS->FreePool(__argvutf8);
+        __argvutf8 = NULL;
+    }
 #endif
     if(__blk_devs) {
         free(__blk_devs);
@@ -66,6 +244,7 @@ void __stdio_seterrno(efi_status_t status)
 
 int fstat (FILE *__f, struct stat *__buf)
 {
+    __stdio_buf_t *b;
     efi_guid_t infGuid = EFI_FILE_INFO_GUID;
     efi_file_info_t info;
     uintn_t fsiz = (uintn_t)sizeof(efi_file_info_t);
@@ -96,6 +275,8 @@ int fstat (FILE *__f, struct stat *__buf)
             __buf->st_blocks = __blk_devs[i].bio->Media->LastBlock + 1;
             return 0;
         }
+    /* pending data changes the size */
+    if((b = __stdio_getbuf(__f)) && b->dirty) __stdio_flushbuf(b);
     status = __f->GetInfo(__f, &infGuid, &fsiz, &info);
     if(EFI_ERROR(status)) {
         __stdio_seterrno(status);
@@ -114,6 +295,7 @@ int fstat (FILE *__f, struct stat *__buf)
 
 int fclose (FILE *__stream)
 {
+    __stdio_buf_t *b;
     efi_status_t status = EFI_SUCCESS;
     uintn_t i;
     if(!__stream) {
@@ -126,13 +308,19 @@ int fclose (FILE *__stream)
     for(i = 0; i < __blk_ndevs; i++)
         if(__stream == (FILE*)__blk_devs[i].bio)
             return 1;
+    if((b = __stdio_getbuf(__stream))) {
+        i = __stdio_flushbuf(b);
+        __stdio_freebuf(b);
+        if(!i) { __stream->Close(__stream); return 0; }
+    }
+    /* the handle belongs to the firmware, closing it frees it */
     status = __stream->Close(__stream);
-    free(__stream);
     return !EFI_ERROR(status);
 }
 
 int fflush (FILE *__stream)
 {
+    __stdio_buf_t *b;
     efi_status_t status = EFI_SUCCESS;
     uintn_t i;
     if(!__stream) {
@@ -140,12 +328,14 @@ int fflush (FILE *__stream)
         return 0;
     }
     if(__stream == stdin || __stream == stdout || __stream == stderr || (__ser && __stream == (FILE*)__ser)) {
+        if(__stream == stdout) __stdio_conflush();
         return 1;
     }
     for(i = 0; i < __blk_ndevs; i++)
         if(__stream == (FILE*)__blk_devs[i].bio) {
             return 1;
         }
+    if((b = __stdio_getbuf(__stream)) && !__stdio_flushbuf(b)) return 0;
     status = __stream->Flush(__stream);
     return !EFI_ERROR(status);
 }
@@ -187,8 +377,7 @@ err:    __stdio_seterrno(status);
         fclose(f);
         return -1;
     }
-    /* no need for fclose(f); */
-    free(f);
+    /* no need for fclose(f), deleting closes the handle */
     return 0;
 }
 
@@ -197,6 +386,57 @@ int remove (const char_t *__filename)
     return __remove(__filename, -1);
 }
 
+int rename (const char_t *__old, const char_t *__new)
+{
+    efi_status_t status;
+    efi_guid_t infGuid = EFI_FILE_INFO_GUID;
+    efi_file_info_t info;
+    uintn_t fsiz = (uintn_t)sizeof(efi_file_info_t), i;
+    const char_t *name;
+    FILE *f;
+    if(!__old || !*__old || !__new || !*__new) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* SetInfo only renames within the same directory, and won't replace an existing file */
+    for(name = __new + strlen(__new); name > __new && name[-1] != CL('/') && name[-1] != CL('\\'); name--);
+    if(!*name) {
+        errno = EINVAL;
+        return -1;
+    }
+    __remove(__new, 0);
+    f = fopen(__old, CL("*"));
+    if(!f || errno)
+        return -1;
+    if(f == stdin || f == stdout || f == stderr || (__ser && f == (FILE*)__ser)) {
+        errno = EBADF;
+        return -1;
+    }
+    for(i = 0; i < __blk_ndevs; i++)
+        if(f == (FILE*)__blk_devs[i].bio) {
+            errno = EBADF;
+            return -1;
+        }
+    status = f->GetInfo(f, &infGuid, &fsiz, &info);
+    if(!EFI_ERROR(status)) {
+        memset(info.FileName, 0, sizeof(info.FileName));
+#ifndef UEFI_NO_UTF8
+        mbstowcs(info.FileName, name, FILENAME_MAX - 1);
+#else
+        for(i = 0; i < FILENAME_MAX - 1 && name[i]; i++) info.FileName[i] = name[i];
+#endif
+        for(i = 0; info.FileName[i]; i++);
+        info.Size = (uintn_t)((uint8_t*)&info.FileName[i + 1] - (uint8_t*)&info);
+        status = f->SetInfo(f, &infGuid, (uintn_t)info.Size, &info);
+    }
+    f->Close(f);
+    if(EFI_ERROR(status)) {
+        __stdio_seterrno(status);
+        return -1;
+    }
+    return 0;
+}
+
 FILE *fopen (const char_t *__filename, const char_t *__modes)
 {
     FILE *ret;
@@ -276,8 +516,8 @@ FILE *fopen (const char_t *__filename, const char_t *__modes)
         errno = ENODEV;
         return NULL;
     }
-    ret = (FILE*)malloc(sizeof(FILE));
-    if(!ret) return NULL;
+    /* the handle is allocated by the firmware */
+    ret = NULL;
     /* normally write means read,write,create. But for remove (internal '*' mode), we need read,write without create
      * also mode 'w' in POSIX means write-only (without read), but that's not working on certain firmware, we must
      * pass read too. This poses a problem of truncating a write-only file, see issue #26, we have to do that manually */
@@ -291,17 +531,25 @@ FILE *fopen (const char_t *__filename, const char_t *__modes)
             EFI_FILE_MODE_READ | (__modes[0] == CL('*') || __modes[1] == CL('+') ? EFI_FILE_MODE_WRITE : 0),
         __modes[1] == CL('d') ? EFI_FILE_DIRECTORY : 0);
     if(EFI_ERROR(status)) {
-err:    __stdio_seterrno(status);
-        free(ret); return NULL;
+        __stdio_seterrno(status);
+        return NULL;
     }
     if(__modes[0] == CL('*')) return ret;
     status = ret->GetInfo(ret, &infGuid, &fsiz, &info);
-    if(EFI_ERROR(status)) goto err;
+    if(EFI_ERROR(status)) {
+        __stdio_seterrno(status);
+        ret->Close(ret); return NULL;
+    }
     if(__modes[1] == CL('d') && !(info.Attribute & EFI_FILE_DIRECTORY)) {
-        ret->Close(ret); free(ret); errno = ENOTDIR; return NULL;
+        ret->Close(ret); errno = ENOTDIR; return NULL;
     }
     if(__modes[1] != CL('d') && (info.Attribute & EFI_FILE_DIRECTORY)) {
-        ret->Close(ret); free(ret); errno = EISDIR; return NULL;
+        ret->Close(ret); errno = EISDIR; return NULL;
+    }
+    if(__modes[1] != CL('d')) {
+        /* files are buffered if there is a free slot, otherwise they still work unbuffered */
+        for(i = 0; i < FOPEN_MAX && __stdio_bufs[i].f; i++);
+        if(i < FOPEN_MAX) { __stdio_bufs[i].f = ret; __stdio_bufs[i].size = BUFSIZ; }
     }
     if(__modes[0] == CL('a')) fseek(ret, 0, SEEK_END);
     if(__modes[0] == CL('w')) {
@@ -316,6 +564,7 @@ err:    __stdio_seterrno(status);
 
 size_t fread (void *__ptr, size_t __size, size_t __n, FILE *__stream)
 {
+    __stdio_buf_t *b;
     uintn_t bs = __size * __n, i, n;
     efi_status_t status;
     if(!__ptr || __size < 1 || __n < 1 || !__stream) {
@@ -341,6 +590,8 @@ size_t fread (void *__ptr, size_t __size, size_t __n, FILE *__stream)
                 __blk_devs[i].offset += bs;
                 return bs / __size;
             }
+        if((b = __stdio_getbuf(__stream)))
+            return __stdio_readbuf(b, (uint8_t*)__ptr, bs) / __size;
         status = __stream->Read(__stream, &bs, __ptr);
     }
     if(EFI_ERROR(status)) {
@@ -352,6 +603,7 @@ size_t fread (void *__ptr, size_t __size, size_t __n, FILE *__stream)
 
 size_t fwrite (const void *__ptr, size_t __size, size_t __n, FILE *__stream)
 {
+    __stdio_buf_t *b;
     uintn_t bs = __size * __n, n, i;
     efi_status_t status;
     if(!__ptr || __size < 1 || __n < 1 || !__stream) {
@@ -377,6 +629,8 @@ size_t fwrite (const void *__ptr, size_t __size, size_t __n, FILE *__stream)
                 __blk_devs[i].offset += bs;
                 return bs / __size;
             }
+        if((b = __stdio_getbuf(__stream)))
+            return __stdio_writebuf(b, (const uint8_t*)__ptr, bs) / __size;
         status = __stream->Write(__stream, &bs, (void *)__ptr);
     }
     if(EFI_ERROR(status)) {
@@ -388,6 +642,7 @@ size_t fwrite (const void *__ptr, size_t __size, size_t __n, FILE *__stream)
 
 int fseek (FILE *__stream, long int __off, int __whence)
 {
+    __stdio_buf_t *b = NULL;
     off_t off = 0;
     efi_status_t status;
     efi_guid_t infoGuid = EFI_FILE_INFO_GUID;
@@ -425,6 +680,15 @@ int fseek (FILE *__stream, long int __off, int __whence)
                 __blk_devs[i].bio->Media->BlockSize;
             return 0;
         }
+    if((b = __stdio_getbuf(__stream))) {
+        /* seeking within read data needs no firmware call */
+        if(__whence == SEEK_CUR) { __off += (long int)(b->off + b->pos); __whence = SEEK_SET; }
+        if(__whence == SEEK_SET && !b->dirty && __off >= 0 && (uint64_t)__off >= b->off && (uint64_t)__off <= b->off + b->len) {
+            b->pos = (uintn_t)((uint64_t)__off - b->off);
+            return 0;
+        }
+        if(!__stdio_dropbuf(b)) return -1;
+    }
     switch(__whence) {
         case SEEK_END:
             status = __stream->GetInfo(__stream, &infoGuid, &fsiz, &info);
@@ -441,14 +705,18 @@ int fseek (FILE *__stream, long int __off, int __whence)
             }
             break;
         default:
-            status = __stream->SetPosition(__stream, __off);
+            off = __off;
+            status = __stream->SetPosition(__stream, off);
             break;
     }
-    return EFI_ERROR(status) ? -1 : 0;
+    if(EFI_ERROR(status)) return -1;
+    if(b) b->off = off;
+    return 0;
 }
 
 long int ftell (FILE *__stream)
 {
+    __stdio_buf_t *b;
     uint64_t off = 0;
     uintn_t i;
     efi_status_t status;
@@ -468,12 +736,15 @@ long int ftell (FILE *__stream)
         if(__stream == (FILE*)__blk_devs[i].bio) {
             return (long int)__blk_devs[i].offset;
         }
+    if((b = __stdio_getbuf(__stream)))
+        return (long int)(b->off + b->pos);
     status = __stream->GetPosition(__stream, &off);
     return EFI_ERROR(status) ? -1 : (long int)off;
 }
 
 int feof (FILE *__stream)
 {
+    __stdio_buf_t *b;
     uint64_t off = 0;
     efi_guid_t infGuid = EFI_FILE_INFO_GUID;
     efi_file_info_t info;
@@ -496,14 +767,21 @@ int feof (FILE *__stream)
             errno = EBADF;
             return __blk_devs[i].offset == (off_t)__blk_devs[i].bio->Media->BlockSize * (off_t)__blk_devs[i].bio->Media->LastBlock;
         }
-    status = __stream->GetPosition(__stream, &off);
-    if(EFI_ERROR(status)) {
-err:    __stdio_seterrno(status);
-        return 1;
+    if((b = __stdio_getbuf(__stream))) {
+        /* buffered data left to read means it's not the end, otherwise compare the position with the size */
+        if(!b->dirty && b->pos < b->len) return 0;
+        if(b->dirty && !__stdio_flushbuf(b)) return 1;
+        off = b->off + b->pos;
+    } else {
+        status = __stream->GetPosition(__stream, &off);
+        if(EFI_ERROR(status)) {
+err:        __stdio_seterrno(status);
+            return 1;
+        }
     }
     status = __stream->GetInfo(__stream, &infGuid, &fsiz, &info);
     if(EFI_ERROR(status)) goto err;
-    __stream->SetPosition(__stream, off);
+    if(!b) __stream->SetPosition(__stream, off);
     return info.FileSize == off;
 }
 
@@ -733,7 +1011,7 @@ int vprintf(const char_t* fmt, __builtin_va_list args)
 #else
     ret = vsnprintf(dst, BUFSIZ, fmt, args);
 #endif
-    ST->ConOut->OutputString(ST->ConOut, (wchar_t *)&dst);
+    __stdio_conwrite(dst);
     return ret;
 }
 
@@ -765,19 +1043,21 @@ int vfprintf (FILE *__stream, const char_t *__format, __builtin_va_list args)
             return -1;
         }
     if(__stream == stdout)
-        ST->ConOut->OutputString(ST->ConOut, (wchar_t*)&dst);
-    else if(__stream == stderr)
+        __stdio_conwrite(dst);
+    else if(__stream == stderr) {
+        /* stderr is unbuffered, but must not overtake what was printed before */
+        __stdio_conflush();
         ST->StdErr->OutputString(ST->StdErr, (wchar_t*)&dst);
-    else if(__ser && __stream == (FILE*)__ser) {
+    } else if(__ser && __stream == (FILE*)__ser) {
 #ifdef UEFI_NO_UTF8
         wcstombs((char*)&tmp, dst, BUFSIZ - 1);
 #endif
         __ser->Write(__ser, &ret, (void*)&tmp);
     } else
 #ifndef UEFI_NO_UTF8
-        __stream->Write(__stream, &ret, (void*)&tmp);
+        ret = fwrite(tmp, 1, ret, __stream);
 #else
-        __stream->Write(__stream, &ret, (void*)&dst);
+        ret = fwrite(dst, 1, ret, __stream);
 #endif
     return (int)ret;
 }
@@ -795,13 +1075,17 @@ int fprintf (FILE *__stream, const char_t *__format, ...)
 int getchar_ifany (void)
 {
     efi_input_key_t key = { 0 };
-    efi_status_t status = ST->ConIn->ReadKeyStroke(ST->ConIn, &key);
+    efi_status_t status;
+    /* show any prompt before waiting for a key */
+    __stdio_conflush();
+    status = ST->ConIn->ReadKeyStroke(ST->ConIn, &key);
     return EFI_ERROR(status) ? 0 : key.UnicodeChar;
 }
 
 int getchar (void)
 {
     uintn_t idx;
+    __stdio_conflush();
     BS->WaitForEvent(1, &ST->ConIn->WaitForKey, &idx);
     return getchar_ifany();
 }
@@ -811,6 +1095,6 @@ int putchar (int __c)
     wchar_t tmp[2];
     tmp[0] = (wchar_t)__c;
     tmp[1] = 0;
-    ST->ConOut->OutputString(ST->ConOut, (__c == L'\n' ? (wchar_t*)L"\r\n" : (wchar_t*)&tmp));
+    __stdio_conwrite(tmp);
     return (int)tmp[0];
 }
@@ -34,8 +34,13 @@ int errno = 0;
 static uint64_t __srand_seed = 6364136223846793005ULL;
 extern void __stdio_cleanup(void);
 #ifndef UEFI_NO_TRACK_ALLOC
-static uintptr_t *__stdlib_allocs = NULL;
-static uintn_t __stdlib_numallocs = 0;
+/* every buffer is preceded by its size, so that finding it takes no lookup. The header is two words long
+ * to keep the pool's alignment, and the second word catches pointers which were not returned by malloc */
+typedef struct {
+    uintn_t size;
+    uintn_t magic;
+} __stdlib_alloc_t;
+#define __STDLIB_ALLOC_MAGIC ((uintn_t)0x636F6C6C614D4546ULL)
 #endif
 
 int atoi(const char_t *s)
@@ -77,29 +82,31 @@ int64_t strtol (const char_t *s, char_t **__endptr, int __base)
     return v * sign;
 }
 
+#ifndef UEFI_NO_TRACK_ALLOC
+/* get the header of a buffer returned by malloc, or NULL if it wasn't */
+static __stdlib_alloc_t *__stdlib_header (void *__ptr)
+{
+    __stdlib_alloc_t *hdr = (__stdlib_alloc_t*)__ptr - 1;
+    return hdr->magic == __STDLIB_ALLOC_MAGIC ? hdr : NULL;
+}
+#endif
+
 void *malloc (size_t __size)
 {
     void *ret = NULL;
     efi_status_t status;
 #ifndef UEFI_NO_TRACK_ALLOC
-    uintn_t i;
-    for(i = 0; i < __stdlib_numallocs && __stdlib_allocs[i] != 0; i += 2);
-    if(i == __stdlib_numallocs) {
-        /* no free slots found, (re)allocate the housekeeping array */
-        status = BS->AllocatePool(LIP ? LIP->ImageDataType : EfiLoaderData, (__stdlib_numallocs + 2) * sizeof(uintptr_t), &ret);
-        if(EFI_ERROR(status) || !ret) { errno = ENOMEM; return NULL; }
-        if(__stdlib_allocs) memcpy(ret, __stdlib_allocs, __stdlib_numallocs * sizeof(uintptr_t));
-        __stdlib_allocs = (uintptr_t*)ret;
-        __stdlib_allocs[i] = __stdlib_allocs[i + 1] = 0;
-        __stdlib_numallocs += 2;
-        ret = NULL;
-    }
-#endif
+    __stdlib_alloc_t *hdr;
+    if(__size > (size_t)-1 - sizeof(__stdlib_alloc_t)) { errno = ENOMEM; return NULL; }
+    status = BS->AllocatePool(LIP ? LIP->ImageDataType : EfiLoaderData, __size + sizeof(__stdlib_alloc_t), &ret);
+    if(EFI_ERROR(status) || !ret) { errno = ENOMEM; return NULL; }
+    hdr = (__stdlib_alloc_t*)ret;
+    hdr->size = (uintn_t)__size;
+    hdr->magic = __STDLIB_ALLOC_MAGIC;
+    ret = hdr + 1;
+#else
     status = BS->AllocatePool(LIP ? LIP->ImageDataType : EfiLoaderData, __size, &ret);
     if(EFI_ERROR(status) || !ret) { errno = ENOMEM; ret = NULL; }
-#ifndef UEFI_NO_TRACK_ALLOC
-    __stdlib_allocs[i] = (uintptr_t)ret;
-    __stdlib_allocs[i + 1] = (uintptr_t)__size;
 #endif
     return ret;
 }
@@ -114,26 +121,25 @@ void *calloc (size_t __nmemb, size_t __size)
 void *realloc (void *__ptr, size_t __size)
 {
     void *ret = NULL;
-    efi_status_t status;
 #ifndef UEFI_NO_TRACK_ALLOC
-    uintn_t i;
+    __stdlib_alloc_t *hdr;
+#else
+    efi_status_t status;
 #endif
     if(!__ptr) return malloc(__size);
     if(!__size) { free(__ptr); return NULL; }
 #ifndef UEFI_NO_TRACK_ALLOC
-    /* get the slot which stores the old size for this buffer */
-    for(i = 0; i < __stdlib_numallocs && __stdlib_allocs[i] != (uintptr_t)__ptr; i += 2);
-    if(i == __stdlib_numallocs) { errno = ENOMEM; return NULL; }
+    /* get the old size for this buffer from its header */
+    hdr = __stdlib_header(__ptr);
+    if(!hdr) { errno = ENOMEM; return NULL; }
+    /* shrinking needs no new buffer */
+    if(__size <= hdr->size) { hdr->size = (uintn_t)__size; return __ptr; }
     /* allocate a new buffer and copy data from old buffer */
-    status = BS->AllocatePool(LIP ? LIP->ImageDataType : EfiLoaderData, __size, &ret);
-    if(EFI_ERROR(status) || !ret) { errno = ENOMEM; ret = NULL; }
-    else {
-        memcpy(ret, (void*)__stdlib_allocs[i], __stdlib_allocs[i + 1] < __size ? __stdlib_allocs[i + 1] : __size);
-        if(__size > __stdlib_allocs[i + 1]) memset((uint8_t*)ret + __stdlib_allocs[i + 1], 0, __size - __stdlib_allocs[i + 1]);
-        /* free old buffer and store new buffer in slot */
-        BS->FreePool((void*)__stdlib_allocs[i]);
-        __stdlib_allocs[i] = (uintptr_t)ret;
-        __stdlib_allocs[i + 1] = (uintptr_t)__size;
+    ret = malloc(__size);
+    if(ret) {
+        memcpy(ret, __ptr, hdr->size);
+        memset((uint8_t*)ret + hdr->size, 0, __size - hdr->size);
+        free(__ptr);
     }
 #else
     status = BS->AllocatePool(LIP ? LIP->ImageDataType : EfiLoaderData, __size, &ret);
@@ -149,18 +155,15 @@ void free (void *__ptr)
 {
     efi_status_t status;
 #ifndef UEFI_NO_TRACK_ALLOC
-    uintn_t i;
+    __stdlib_alloc_t *hdr;
 #endif
     if(!__ptr) { errno = ENOMEM; return; }
 #ifndef UEFI_NO_TRACK_ALLOC
-    /* find and clear the slot */
-    for(i = 0; i < __stdlib_numallocs && __stdlib_allocs[i] != (uintptr_t)__ptr; i += 2);
-    if(i == __stdlib_numallocs) { errno = ENOMEM; return; }
-    __stdlib_allocs[i] = 0;
-    __stdlib_allocs[i + 1] = 0;
-    /* if there are only empty slots, free the housekeeping array too */
-    for(i = 0; i < __stdlib_numallocs && __stdlib_allocs[i] == 0; i += 2);
-    if(i == __stdlib_numallocs) { BS->FreePool(__stdlib_allocs); __stdlib_allocs = NULL; __stdlib_numallocs = 0; }
+    /* clear the header, so that freeing the buffer twice is caught */
+    hdr = __stdlib_header(__ptr);
+    if(!hdr) { errno = ENOMEM; return; }
+    hdr->magic = 0;
+    __ptr = hdr;
 #endif
     status = BS->FreePool(__ptr);
     if(EFI_ERROR(status)) errno = ENOMEM;
@@ -168,24 +171,12 @@ void free (void *__ptr)
 
 void abort ()
 {
-#ifndef UEFI_NO_TRACK_ALLOC
-    if(__stdlib_allocs)
-        BS->FreePool(__stdlib_allocs);
-    __stdlib_allocs = NULL;
-    __stdlib_numallocs = 0;
-#endif
     __stdio_cleanup();
     BS->Exit(IM, EFI_ABORTED, 0, NULL);
 }
 
 void exit (int __status)
 {
-#ifndef UEFI_NO_TRACK_ALLOC
-    if(__stdlib_allocs)
-        BS->FreePool(__stdlib_allocs);
-    __stdlib_allocs = NULL;
-    __stdlib_numallocs = 0;
-#endif
     __stdio_cleanup();
     BS->Exit(IM, !__status ? 0 : (__status < 0 ? EFIERR(-__status) : EFIERR(__status)), 0, NULL);
 }
@@ -195,12 +186,6 @@ int exit_bs()
     efi_status_t status = 0;
     efi_memory_descriptor_t *memory_map = NULL;
     uintn_t cnt = 3, memory_map_size=0, map_key=0, desc_size=0;
-#ifndef UEFI_NO_TRACK_ALLOC
-    if(__stdlib_allocs)
-        BS->FreePool(__stdlib_allocs);
-    __stdlib_allocs = NULL;
-    __stdlib_numallocs = 0;
-#endif
     __stdio_cleanup();
     while(cnt--) {
         status = BS->GetMemoryMap(&memory_map_size, memory_map, &map_key, &desc_size, NULL);
@@ -30,10 +30,55 @@
 
 #include <uefi.h>
 
+/* the firmware runs with unaligned accesses allowed on both x86_64 and aarch64, so words are
+ * stored aligned on the destination and loaded from wherever the source happens to be */
+typedef uint64_t __attribute__((__may_alias__)) __word_t;
+typedef uint64_t __attribute__((__may_alias__, __aligned__(1))) __uword_t;
+#define __ONES  0x0101010101010101ULL
+#define __HIGHS 0x8080808080808080ULL
+/* non-zero if any byte of the word is zero */
+#define __HASZERO(w) (((w) - __ONES) & ~(w) & __HIGHS)
+
+#ifdef __x86_64__
+/* rep movsb and rep stosb beat the word loops on CPUs with Enhanced REP MOVSB/STOSB, once the
+ * length covers their startup cost */
+#define __ERMS_MIN 512
+static int __erms = -1;
+
+static int __has_erms(void)
+{
+    uint32_t a, b, c, d;
+    if(__erms < 0) {
+        __asm__ __volatile__ ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0), "c"(0));
+        __erms = 0;
+        if(a >= 7) {
+            __asm__ __volatile__ ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(7), "c"(0));
+            __erms = (b >> 9) & 1;
+        }
+    }
+    return __erms;
+}
+#endif
+
 void *memcpy(void *dst, const void *src, size_t n)
 {
     uint8_t *a=(uint8_t*)dst,*b=(uint8_t*)src;
+    uint64_t w0, w1, w2, w3;
     if(src && dst && src != dst && n>0) {
+#ifdef __x86_64__
+        if(n >= __ERMS_MIN && __has_erms()) {
+            __asm__ __volatile__ ("rep movsb" : "+D"(a), "+S"(b), "+c"(n) : : "memory");
+            return dst;
+        }
+#endif
+        if(n >= 16) {
+            while((uintptr_t)a & 7) { *a++ = *b++; n--; }
+            for(; n >= 32; a += 32, b += 32, n -= 32) {
+                w0 = ((__uword_t*)b)[0]; w1 = ((__uword_t*)b)[1]; w2 = ((__uword_t*)b)[2]; w3 = ((__uword_t*)b)[3];
+                ((__word_t*)a)[0] = w0; ((__word_t*)a)[1] = w1; ((__word_t*)a)[2] = w2; ((__word_t*)a)[3] = w3;
+            }
+            for(; n >= 8; a += 8, b += 8, n -= 8) *(__word_t*)a = *(__uword_t*)b;
+        }
         while(n--) *a++ = *b++;
     }
     return dst;
@@ -44,10 +89,21 @@ void *memmove(void *dst, const void *src, size_t n)
     uint8_t *a=(uint8_t*)dst,*b=(uint8_t*)src;
     if(src && dst && src != dst && n>0) {
         if(a>b && a<b+n) {
-            a+=n-1; b+=n-1; while(n-->0) *a--=*b--;
-        } else {
+            a+=n; b+=n;
+            if(n >= 16) {
+                while((uintptr_t)a & 7) { *--a = *--b; n--; }
+                for(; n >= 8; n -= 8) { a -= 8; b -= 8; *(__word_t*)a = *(__uword_t*)b; }
+            }
+            while(n--) *--a = *--b;
+        } else if(b>a && b<a+n) {
+            /* rep movsb copes with this overlap too, but is slow at it */
+            if(n >= 16) {
+                while((uintptr_t)a & 7) { *a++ = *b++; n--; }
+                for(; n >= 8; a += 8, b += 8, n -= 8) *(__word_t*)a = *(__uword_t*)b;
+            }
             while(n--) *a++ = *b++;
-        }
+        } else
+            memcpy(dst, src, n);
     }
     return dst;
 }
@@ -55,7 +111,22 @@ void *memmove(void *dst, const void *src, size_t n)
 void *memset(void *s, int c, size_t n)
 {
     uint8_t *p=(uint8_t*)s;
+    uint64_t w;
     if(s && n>0) {
+#ifdef __x86_64__
+        if(n >= __ERMS_MIN && __has_erms()) {
+            __asm__ __volatile__ ("rep stosb" : "+D"(p), "+c"(n) : "a"(c) : "memory");
+            return s;
+        }
+#endif
+        if(n >= 16) {
+            w = (uint8_t)c * __ONES;
+            while((uintptr_t)p & 7) { *p++ = (uint8_t)c; n--; }
+            for(; n >= 32; p += 32, n -= 32) {
+                ((__word_t*)p)[0] = w; ((__word_t*)p)[1] = w; ((__word_t*)p)[2] = w; ((__word_t*)p)[3] = w;
+            }
+            for(; n >= 8; p += 8, n -= 8) *(__word_t*)p = w;
+        }
         while(n--) *p++ = (uint8_t)c;
     }
     return s;
@@ -65,6 +136,8 @@ int memcmp(const void *s1, const void *s2, size_t n)
 {
     uint8_t *a=(uint8_t*)s1,*b=(uint8_t*)s2;
     if(s1 && s2 && s1 != s2 && n>0) {
+        /* skip equal words, then find the differing byte one at a time */
+        for(; n >= 8 && *(__uword_t*)a == *(__uword_t*)b; a += 8, b += 8, n -= 8);
         while(n--) {
             if(*a != *b) return *a - *b;
             a++; b++;
@@ -76,8 +149,19 @@ int memcmp(const void *s1, const void *s2, size_t n)
 void *memchr(const void *s, int c, size_t n)
 {
     uint8_t *e, *p=(uint8_t*)s;
+    uint64_t w, m;
     if(s && n>0) {
-        for(e=p+n; p<e; p++) if(*p==(uint8_t)c) return p;
+        e = p + n;
+        if(n >= 16) {
+            while((uintptr_t)p & 7) { if(*p==(uint8_t)c) return p; p++; }
+            /* aligned words never cross into another page */
+            m = (uint8_t)c * __ONES;
+            for(; p + 8 <= e; p += 8) {
+                w = *(__word_t*)p ^ m;
+                if(__HASZERO(w)) break;
+            }
+        }
+        for(; p<e; p++) if(*p==(uint8_t)c) return p;
     }
     return NULL;
 }
@@ -93,12 +177,14 @@ void *memrchr(const void *s, int c, size_t n)
 
 void *memmem(const void *haystack, size_t hl, const void *needle, size_t nl)
 {
-    uint8_t *c = (uint8_t*)haystack;
+    uint8_t *c = (uint8_t*)haystack, *e, first;
     if(!haystack || !needle || !hl || !nl || nl > hl) return NULL;
-    hl -= nl - 1;
-    while(hl) {
-        if(!memcmp(c, needle, nl)) return c;
-        c++; hl--;
+    /* let memchr find candidates for the first byte, and only compare the rest there */
+    first = *(uint8_t*)needle;
+    e = c + hl - nl + 1;
+    while(c < e && (c = (uint8_t*)memchr(c, first, e - c))) {
+        if(!memcmp(c + 1, (uint8_t*)needle + 1, nl - 1)) return c;
+        c++;
     }
     return NULL;
 }
@@ -254,9 +340,21 @@ char_t *strtok_r(char_t *s, const char_t *delim, char_t **ptr)
 
 size_t strlen (const char_t *__s)
 {
-    size_t ret;
+    const char_t *p = __s;
+    uint64_t w;
+#ifndef UEFI_NO_UTF8
+    const uint64_t ones = __ONES, highs = __HIGHS;
+#else
+    const uint64_t ones = 0x0001000100010001ULL, highs = 0x8000800080008000ULL;
+#endif
 
     if(!__s) return 0;
-    for(ret = 0; __s[ret]; ret++);
-    return ret;
+    /* aligned words never cross into another page, so reading past the terminator is harmless */
+    while((uintptr_t)p & 7) { if(!*p) return p - __s; p++; }
+    for(;; p += 8 / sizeof(char_t)) {
+        w = *(__word_t*)p;
+        if((w - ones) & ~w & highs) break;
+    }
+    while(*p) p++;
+    return p - __s;
 }
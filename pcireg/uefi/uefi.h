@@ -1206,6 +1206,82 @@ typedef struct {
   efi_pci_option_rom_descriptor_t   *PciOptionRomDescriptors;
 } efi_pci_option_rom_table_t;
 
+/*** PCI Root Bridge IO Protocol ***/
+#ifndef EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_GUID
+#define EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_GUID { 0x2f707ebb, 0x4a1a, 0x11d4, {0x9a, 0x38, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d} }
+
+typedef enum {
+    EfiPciWidthUint8,
+    EfiPciWidthUint16,
+    EfiPciWidthUint32,
+    EfiPciWidthUint64,
+    EfiPciWidthFifoUint8,
+    EfiPciWidthFifoUint16,
+    EfiPciWidthFifoUint32,
+    EfiPciWidthFifoUint64,
+    EfiPciWidthFillUint8,
+    EfiPciWidthFillUint16,
+    EfiPciWidthFillUint32,
+    EfiPciWidthFillUint64,
+    EfiPciWidthMaximum
+} efi_pci_root_bridge_io_width_t;
+
+#else
+
+#define efi_pci_root_bridge_io_width_t EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH
+
+#endif
+
+/* configuration space addresses are (Bus << 24) | (Device << 16) | (Function << 8) | Register,
+ * with registers above 0xFF given in the upper 32 bits instead */
+#define EFI_PCI_ADDRESS(bus, dev, func, reg) \
+    (((uint64_t)(bus) << 24) | ((uint64_t)(dev) << 16) | ((uint64_t)(func) << 8) | \
+    ((reg) > 0xff ? ((uint64_t)(reg) << 32) : (uint64_t)(reg)))
+
+typedef efi_status_t (EFIAPI *efi_pci_root_bridge_io_poll_t)(void *This, efi_pci_root_bridge_io_width_t Width,
+    uint64_t Address, uint64_t Mask, uint64_t Value, uint64_t Delay, uint64_t *Result);
+typedef efi_status_t (EFIAPI *efi_pci_root_bridge_io_mem_t)(void *This, efi_pci_root_bridge_io_width_t Width,
+    uint64_t Address, uintn_t Count, void *Buffer);
+typedef efi_status_t (EFIAPI *efi_pci_root_bridge_io_copy_mem_t)(void *This, efi_pci_root_bridge_io_width_t Width,
+    uint64_t DestAddress, uint64_t SrcAddress, uintn_t Count);
+typedef efi_status_t (EFIAPI *efi_pci_root_bridge_io_map_t)(void *This, uint32_t Operation, void *HostAddress,
+    uintn_t *NumberOfBytes, efi_physical_address_t *DeviceAddress, void **Mapping);
+typedef efi_status_t (EFIAPI *efi_pci_root_bridge_io_unmap_t)(void *This, void *Mapping);
+typedef efi_status_t (EFIAPI *efi_pci_root_bridge_io_allocate_buffer_t)(void *This, efi_allocate_type_t Type,
+    efi_memory_type_t MemoryType, uintn_t Pages, void **HostAddress, uint64_t Attributes);
+typedef efi_status_t (EFIAPI *efi_pci_root_bridge_io_free_buffer_t)(void *This, uintn_t Pages, void *HostAddress);
+typedef efi_status_t (EFIAPI *efi_pci_root_bridge_io_flush_t)(void *This);
+typedef efi_status_t (EFIAPI *efi_pci_root_bridge_io_get_attributes_t)(void *This, uint64_t *Supports,
+    uint64_t *Attributes);
+typedef efi_status_t (EFIAPI *efi_pci_root_bridge_io_set_attributes_t)(void *This, uint64_t Attributes,
+    uint64_t *ResourceBase, uint64_t *ResourceLength);
+/* returns ACPI QWORD address space descriptors (0x8A) terminated by an end tag (0x79) */
+typedef efi_status_t (EFIAPI *efi_pci_root_bridge_io_configuration_t)(void *This, void **Resources);
+
+typedef struct {
+    efi_pci_root_bridge_io_mem_t    Read;
+    efi_pci_root_bridge_io_mem_t    Write;
+} efi_pci_root_bridge_io_access_t;
+
+typedef struct {
+    efi_handle_t                            ParentHandle;
+    efi_pci_root_bridge_io_poll_t           PollMem;
+    efi_pci_root_bridge_io_poll_t           PollIo;
+    efi_pci_root_bridge_io_access_t         Mem;
+    efi_pci_root_bridge_io_access_t         Io;
+    efi_pci_root_bridge_io_access_t         Pci;
+    efi_pci_root_bridge_io_copy_mem_t       CopyMem;
+    efi_pci_root_bridge_io_map_t            Map;
+    efi_pci_root_bridge_io_unmap_t          Unmap;
+    efi_pci_root_bridge_io_allocate_buffer_t AllocateBuffer;
+    efi_pci_root_bridge_io_free_buffer_t    FreeBuffer;
+    efi_pci_root_bridge_io_flush_t          Flush;
+    efi_pci_root_bridge_io_get_attributes_t GetAttributes;
+    efi_pci_root_bridge_io_set_attributes_t SetAttributes;
+    efi_pci_root_bridge_io_configuration_t  Configuration;
+    uint32_t                                SegmentNumber;
+} efi_pci_root_bridge_io_protocol_t;
+
 /*** GPT partitioning table (not used, but could be useful to have) ***/
 typedef struct {
     efi_table_header_t  Header;
@@ -1317,6 +1393,12 @@ extern int setenv(char_t *name, uintn_t len, uint8_t *data);
 #ifndef BUFSIZ
 #define BUFSIZ 8192
 #endif
+#ifndef FOPEN_MAX
+#define FOPEN_MAX 16        /* files which can be buffered at once, more are opened unbuffered */
+#endif
+#define _IOFBF		0	/* Fully buffered.  */
+#define _IOLBF		1	/* Line buffered, same as fully buffered for files.  */
+#define _IONBF		2	/* No buffering.  */
 #define SEEK_SET	0	/* Seek from beginning of file.  */
 #define SEEK_CUR	1	/* Seek from current position.  */
 #define SEEK_END	2	/* Seek from end of file.  */
@@ -1326,7 +1408,10 @@ extern int setenv(char_t *name, uintn_t len, uint8_t *data);
 typedef struct efi_file_handle_s FILE;
 extern int fclose (FILE *__stream);
 extern int fflush (FILE *__stream);
+extern int setvbuf (FILE *__stream, char *__buf, int __modes, size_t __n);
+extern void setbuf (FILE *__stream, char *__buf);
 extern int remove (const char_t *__filename);
+extern int rename (const char_t *__old, const char_t *__new);
 extern FILE *fopen (const char_t *__filename, const char_t *__modes);
 extern size_t fread (void *__ptr, size_t __size, size_t __n, FILE *__stream);
 extern size_t fwrite (const void *__ptr, size_t __size, size_t __n, FILE *__s);